@@ -0,0 +1,57 @@
+#include "busy_poll.hh"
+
+#include "log.hh"
+
+#include <algorithm>
+
+using std::chrono::steady_clock;
+using std::chrono::duration_cast;
+using std::chrono::milliseconds;
+
+BusyPoller::BusyPoller(const std::chrono::microseconds budget)
+    : _budget(budget)
+    , _spinning(0)
+    , _blocked(0)
+    , _nspun(0)
+    , _nblocked(0)
+    {}
+
+bool BusyPoller::enabled() const {
+    return _budget.count() > 0;
+}
+
+std::chrono::microseconds BusyPoller::budget() const {
+    return duration_cast<std::chrono::microseconds>(_budget);
+}
+
+int BusyPoller::poll(pollfd* fds, const nfds_t nfds, const int timeout) {
+    if (!enabled() || timeout == 0)
+        return ::poll(fds, nfds, timeout);
+
+    const auto start = steady_clock::now();
+    int nready = 0;
+    if (spin([&] { return (nready = ::poll(fds, nfds, 0)) != 0; }))
+        return nready;
+
+    int remaining = timeout;
+    if (timeout > 0)
+        remaining = std::max(0, timeout - (int)duration_cast<milliseconds>(steady_clock::now() - start).count());
+    return block(fds, nfds, remaining);
+}
+
+int BusyPoller::block(pollfd* fds, const nfds_t nfds, const int timeout) {
+    const auto start = steady_clock::now();
+    int nready = ::poll(fds, nfds, timeout);
+    _blocked += steady_clock::now() - start;
+    _nblocked++;
+    return nready;
+}
+
+void BusyPoller::report(const std::string& name) const {
+    const size_t nwakeups = _nspun + _nblocked;
+    if (!enabled() || !nwakeups)
+        return;
+    log_info("[%s] spun for %.3f s, blocked for %.3f s; %zu of %zu wakeups (%.1f%%) caught while spinning",
+        name.c_str(), _spinning.count() / 1e9, _blocked.count() / 1e9,
+        _nspun, nwakeups, nwakeups ? 100.0 * _nspun / nwakeups : 0.0);
+}
@@ -0,0 +1,86 @@
+#pragma once
+
+#include <poll.h>
+#include <cstddef>
+
+#include <chrono>
+#include <string>
+
+/**
+ * @class BusyPoller
+ * @brief A `poll()` that spins for a while before it blocks.
+ *
+ * For hot loops that care about latency more than CPU: instead of going to sleep right away,
+ * the descriptors are polled without blocking until one is ready or the spin budget runs out,
+ * and only then does the thread block in `poll()`. With a zero budget it's a plain `poll()`.
+ * A `poll()` that doesn't block never busy polls the device queue, though, so loops reading
+ * sockets with `SO_BUSY_POLL` set `spin()` on their non-blocking receives instead.
+ *
+ * Keeps track of the time spent spinning versus blocked, to tune the budget by.
+ */
+class BusyPoller {
+private:
+    std::chrono::nanoseconds _budget;   ///< How long to spin before blocking.
+    std::chrono::nanoseconds _spinning; ///< Total time spent spinning.
+    std::chrono::nanoseconds _blocked;  ///< Total time spent blocked.
+    size_t _nspun;                      ///< Number of wakeups caught while spinning.
+    size_t _nblocked;                   ///< Number of wakeups after blocking.
+
+public:
+    /**
+     * @brief Constructs a poller.
+     * @param budget How long to spin before blocking (0 - never spin).
+     */
+    BusyPoller(std::chrono::microseconds budget);
+
+    /// @return True if the poller spins at all.
+    bool enabled() const;
+
+    /// @return The spin budget.
+    std::chrono::microseconds budget() const;
+
+    /**
+     * @brief Waits for the descriptors like `poll()`, spinning first.
+     * @param fds Descriptors to wait for.
+     * @param nfds Number of descriptors.
+     * @param timeout Timeout in milliseconds, as in `poll()` (-1 - infinite).
+     * @return Same as `poll()`.
+     */
+    int poll(pollfd* fds, nfds_t nfds, int timeout);
+
+    /**
+     * @brief Calls `ready` until it returns true or the spin budget runs out.
+     * @param ready Tries to make progress without blocking, e.g. a non-blocking receive.
+     * @return True if `ready` returned true, false if it never did or spinning is disabled.
+     */
+    template <typename F>
+    bool spin(F&& ready) {
+        if (!enabled())
+            return false;
+        const auto start = std::chrono::steady_clock::now();
+        auto now    = start;
+        bool caught = false;
+        while (!caught && now - start < _budget) {
+            caught = ready();
+            now    = std::chrono::steady_clock::now();
+        }
+        _spinning += now - start;
+        _nspun    += caught;
+        return caught;
+    }
+
+    /**
+     * @brief Blocks in `poll()`, for after `spin()` came up empty.
+     * @param fds Descriptors to wait for.
+     * @param nfds Number of descriptors.
+     * @param timeout Timeout in milliseconds, as in `poll()` (-1 - infinite).
+     * @return Same as `poll()`.
+     */
+    int block(pollfd* fds, nfds_t nfds, int timeout);
+
+    /**
+     * @brief Logs the time spent spinning and blocked, if spinning is enabled.
+     * @param name Name of the worker, for logging.
+     */
+    void report(const std::string& name) const;
+};
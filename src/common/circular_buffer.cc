@@ -2,171 +2,300 @@
 #include "./log.hh"
 
 #include <unistd.h>
+#include <sys/mman.h>
 #include <cstring>
 #include <cassert>
 
 #include <algorithm>
+#include <bit>
 
-CircularBuffer::CircularBuffer(const size_t capacity)
+CircularBuffer::CircularBuffer(const size_t capacity, const size_t reorder_window)
     : _abs_head(0)
     , _byte0(0)
     , _capacity(capacity)
+    , _reorder_window(reorder_window)
+    , _window(0)
     , _psize(0)
+    , _nslots(0)
+    , _slot_mask(0)
     , _tail(0)
     , _head(0)
+    , _memfd(-1)
+    , _map_size(0)
+    , _mirror(0)
     , _empty(true)
+    , _ndue(0)
+    , _put(&CircularBuffer::put<0>)
+    , _dump(&CircularBuffer::dump<0>)
 {
+    if (map_data())
+        return;
     try {
-        _data     = new char[capacity]();
-        _occupied = new bool[capacity]();
+        _data = new char[capacity]();
     } catch (const std::exception& e)
         fatal(e.what());
 }
 
+bool CircularBuffer::map_data() {
+    const size_t page = sysconf(_SC_PAGESIZE);
+    const size_t size = (_capacity + page - 1) / page * page;
+    int fd = memfd_create("circular_buffer", MFD_CLOEXEC);
+    if (fd == -1)
+        return false;
+    // room for the buffer and a second copy right behind it, mapped over it once the packet size is known
+    void* base = MAP_FAILED;
+    if (ftruncate(fd, size) == -1
+        || (base = mmap(nullptr, 2 * size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0)) == MAP_FAILED
+        || mmap(base, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED) {
+        if (base != MAP_FAILED)
+            munmap(base, 2 * size);
+        close(fd);
+        return false;
+    }
+    _memfd    = fd;
+    _map_size = size;
+    _data     = (char*)base;
+    return true;
+}
+
+void CircularBuffer::mirror(const size_t len) {
+    if (_memfd == -1)
+        return;
+    const size_t page = sysconf(_SC_PAGESIZE);
+    const size_t want = len % page == 0 ? len : 0;
+    if (want == _mirror)
+        return;
+
+    // the first copy has to be flat again, it may overlap the second copy of a shorter period
+    if (mmap(_data, _map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, _memfd, 0) == MAP_FAILED)
+        fatal("mmap");
+    _mirror = 0;
+    if (want != 0 && mmap(_data + want, want, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, _memfd, 0) != MAP_FAILED)
+        _mirror = want;
+}
+
 size_t CircularBuffer::capacity() const {
     return _capacity;
 }
 
 size_t CircularBuffer::rounded_cap() const {
-    return _capacity / _psize * _psize;
+    return _nslots * _psize;
 }
 
 CircularBuffer::~CircularBuffer() {
-    delete[] _data;
-    delete[] _occupied;
+    if (_memfd == -1) {
+        delete[] _data;
+        return;
+    }
+    munmap(_data, 2 * _map_size);
+    if (close(_memfd) == -1)
+        fatal("close");
 }
 
-CircularBuffer::side CircularBuffer::sideof(const size_t idx) const {
+CircularBuffer::side CircularBuffer::sideof(const size_t slot) const {
     if (_tail <= _head) {
-        if (_tail <= idx && idx <= _head)
+        if (_tail <= slot && slot <= _head)
             return LEFT;
     } else {
-        if (idx <= _head)
+        if (slot <= _head)
             return LEFT;
-        else if (_tail <= idx && idx < rounded_cap())
+        else if (_tail <= slot && slot < _nslots)
             return RIGHT;
     }
     return NONE;
 }
 
+size_t CircularBuffer::wrap(const size_t slot) const {
+    return _slot_mask ? slot & _slot_mask : slot % _nslots;
+}
+
+char* CircularBuffer::at(const size_t slot) const {
+    return _data + slot * _psize;
+}
+
+size_t CircularBuffer::slot_range() const {
+    if (_tail <= _head)
+        return _head - _tail;
+    else
+        return _head + (_nslots - _tail);
+}
+
+bool CircularBuffer::slot_occupied(const size_t slot) const {
+    return (_occupied[slot / 64] >> (slot % 64)) & 1;
+}
+
+void CircularBuffer::set_occupied(const size_t slot) {
+    _occupied[slot / 64] |= uint64_t(1) << (slot % 64);
+}
+
+void CircularBuffer::clear_occupied(size_t slot, size_t n) {
+    while (n > 0) {
+        const size_t bit  = slot % 64;
+        const size_t len  = std::min({n, _nslots - slot, 64 - bit});
+        const uint64_t ones = len == 64 ? ~uint64_t(0) : (uint64_t(1) << len) - 1;
+        _occupied[slot / 64] &= ~(ones << bit);
+        n   -= len;
+        slot = wrap(slot + len);
+    }
+}
+
+size_t CircularBuffer::find_slot(const size_t from, const size_t n, const bool value) const {
+    const uint64_t flip = value ? 0 : ~uint64_t(0); // looking for zeros => look for ones in the complement
+    size_t slot = from, done = 0;
+    while (done < n) {
+        const size_t bit = slot % 64;
+        const size_t len = std::min({n - done, _nslots - slot, 64 - bit});
+        uint64_t word = (_occupied[slot / 64] ^ flip) >> bit;
+        if (len < 64)
+            word &= (uint64_t(1) << len) - 1;
+        if (word)
+            return done + std::countr_zero(word);
+        done += len;
+        slot  = wrap(slot + len);
+    }
+    return n;
+}
+
 void CircularBuffer::reset(const size_t psize) {
-    _tail  = _head = 0;
-    _psize = psize;
-    _empty = true;
-    memset(_data, 0, _capacity);
-    memset(_occupied, 0, _capacity);
+    _tail      = _head = 0;
+    _psize     = psize;
+    _nslots    = _capacity / psize;
+    _slot_mask = std::has_single_bit(_nslots) ? _nslots - 1 : 0;
+    _window    = std::min(_reorder_window, _nslots - 1);
+    _empty     = true;
+    mirror(rounded_cap());
+    // the data is left as it is, only occupied slots are ever read
+    _occupied.assign((_nslots + 63) / 64, 0);
+
+    // the packet sizes stations use the most get copies and divisions by a constant
+    switch (psize) {
+        case 512:
+            _put  = &CircularBuffer::put<512>;
+            _dump = &CircularBuffer::dump<512>;
+            break;
+        case 1024:
+            _put  = &CircularBuffer::put<1024>;
+            _dump = &CircularBuffer::dump<1024>;
+            break;
+        default:
+            _put  = &CircularBuffer::put<0>;
+            _dump = &CircularBuffer::dump<0>;
+    }
 }
 
 void CircularBuffer::reset(const size_t psize, const uint64_t abs_head) {
     _abs_head = _byte0 = abs_head;
+    _ndue     = 0;
     reset(psize);
 }
 
 void CircularBuffer::dump_tail(const size_t nbytes) {
-    assert(nbytes % _psize == 0);
-    size_t fst_chunk = nbytes;
+    (this->*_dump)(nbytes);
+}
+
+template <size_t PSIZE>
+void CircularBuffer::dump(const size_t nbytes) {
+    const size_t psize = PSIZE ? PSIZE : _psize;
+    assert(nbytes % psize == 0);
+    const size_t n   = nbytes / psize;
+    size_t fst_chunk = n;
     size_t snd_chunk = 0;
-    if (_tail > _head && fst_chunk > rounded_cap() - _tail) {
-        fst_chunk = rounded_cap() - _tail;
-        snd_chunk = nbytes - fst_chunk;
+    if (!_mirror && _tail > _head && fst_chunk > _nslots - _tail) {
+        fst_chunk = _nslots - _tail;
+        snd_chunk = n - fst_chunk;
     }
 
-    size_t nwritten = write(STDOUT_FILENO, _data + _tail, fst_chunk);
-    nwritten += write(STDOUT_FILENO, _data, snd_chunk);
-    if (nwritten != fst_chunk + snd_chunk)
-        fatal("write");
+    // slots nothing arrived for go out as silence - they aren't cleared when they're vacated
+    for (size_t off = find_slot(_tail, n, false); off < n;) {
+        memset(_data + wrap(_tail + off) * psize, 0, psize);
+        ++off;
+        off += find_slot(wrap(_tail + off), n - off, false);
+    }
 
-    memset(_data + _tail, 0, fst_chunk);
-    memset(_occupied + _tail, 0, fst_chunk);
+    size_t nwritten = write(STDOUT_FILENO, _data + _tail * psize, fst_chunk * psize);
+    if (snd_chunk > 0)
+        nwritten += write(STDOUT_FILENO, _data, snd_chunk * psize);
+    if (nwritten != nbytes)
+        fatal("write");
 
-    memset(_data, 0, snd_chunk);
-    memset(_occupied, 0, snd_chunk);
+    clear_occupied(_tail, n);
 
-    _tail = (_tail + nbytes) % rounded_cap();
+    _tail = wrap(_tail + n);
 }
 
+template <size_t PSIZE>
 void CircularBuffer::fill_gap(const AudioPacket& packet) {
-    size_t tail_offset = packet.first_byte_num - abs_tail();
-
-    assert(tail_offset % _psize == 0);
-    auto side = sideof(tail_offset);
-    assert(side != NONE);
-    size_t pos = _tail + tail_offset;
-    if (_tail > _head && side == LEFT)
-        pos -= rounded_cap() - _tail;
-    memcpy(_data + pos, packet.audio_data(), _psize);
-    _occupied[pos] = true;
+    const size_t psize   = PSIZE ? PSIZE : _psize;
+    uint64_t tail_offset = packet.first_byte_num - abs_tail();
+
+    assert(tail_offset % psize == 0);
+    assert(tail_offset < range());
+    size_t pos = wrap(_tail + tail_offset / psize);
+    assert(sideof(pos) != NONE);
+    memcpy(_data + pos * psize, packet.audio_data(), psize);
+    set_occupied(pos);
     _empty = false;
 }
 
-void CircularBuffer::try_push_head(const AudioPacket& packet) {
+template <size_t PSIZE>
+bool CircularBuffer::try_push_head(const AudioPacket& packet) {
+    const size_t psize   = PSIZE ? PSIZE : _psize;
     uint64_t head_offset = packet.first_byte_num - _abs_head;
-    assert(head_offset % _psize == 0);
-    if (head_offset > _psize) // dismiss, packet is too far ahead
-        return;
-
-    _abs_head = packet.first_byte_num + _psize;
-    if (head_offset >= rounded_cap()) {
-        reset(_psize);
-        memcpy(_data, packet.audio_data(), _psize);
-        _occupied[0] = true;
-        _head        = _psize;
-        _tail        = (_head + _psize) % rounded_cap();
-        _empty = false;
-        return;
-    }
-
-    _empty = false;
-    size_t write_pos = (_head + head_offset) % rounded_cap();
-
-    if (write_pos >= _head) {
-        memset(_data + _head    , 0, write_pos - _head);
-        memset(_occupied + _head, 0, write_pos - _head);
-    } else {
-        memset(_data + _head, 0, rounded_cap() - _head);
-        memset(_data        , 0, write_pos);
-        memset(_occupied + _head, 0, rounded_cap() - _head);
-        memset(_occupied        , 0, write_pos);
-    }
-    memcpy(_data + write_pos, packet.audio_data(), _psize);
-    _occupied[write_pos] = true;
-
-    size_t virt_new_head = _head + head_offset + _psize;
-    size_t new_head      = virt_new_head % rounded_cap();
-    size_t new_tail      = (new_head + _psize) % rounded_cap();
-    if (virt_new_head >= rounded_cap() && ((_tail <= _head && _tail <= new_head) || _head < _tail))
+    assert(head_offset % psize == 0);
+    size_t nskipped = head_offset / psize;
+    if (nskipped > _window) // too far ahead to wait for what's in between, the caller resyncs
+        return false;
+
+    _abs_head = packet.first_byte_num + psize;
+    _empty    = false;
+    size_t write_pos = wrap(_head + nskipped);
+
+    clear_occupied(_head, nskipped);
+    memcpy(_data + write_pos * psize, packet.audio_data(), psize);
+    set_occupied(write_pos);
+
+    size_t virt_new_head = _head + nskipped + 1;
+    size_t new_head      = wrap(virt_new_head);
+    size_t new_tail      = wrap(new_head + 1);
+    if (virt_new_head >= _nslots && ((_tail <= _head && _tail <= new_head) || _head < _tail))
         _tail = new_tail;
     else if (_head < _tail && _tail <= new_head)
         _tail = new_tail;
 
     _head = new_head;
+    return true;
+}
+
+bool CircularBuffer::try_put(const AudioPacket& packet) {
+    return (this->*_put)(packet);
 }
 
-void CircularBuffer::try_put(const AudioPacket& packet) {
+template <size_t PSIZE>
+bool CircularBuffer::put(const AudioPacket& packet) {
     if (packet.first_byte_num < abs_tail())
-        return;  // dismiss, packet is too far behind
+        return true; // dismiss, packet is too far behind
     if (packet.first_byte_num >= _abs_head)
-        try_push_head(packet); // advance
-    else
-        fill_gap(packet); // fill in a gap
+        return try_push_head<PSIZE>(packet); // advance
+    fill_gap<PSIZE>(packet); // fill in a gap
+    return true;
 }
 
 size_t CircularBuffer::cnt_upto_gap() const {
-    size_t cnt = 0, i = _tail;
-    do {
-        if (!_occupied[i])
-            break;
-        cnt++;
-        i = (i + _psize) % rounded_cap();
-    } while (i != _tail);
-    return cnt;
+    return find_slot(_tail, _nslots, false);
+}
+
+void CircularBuffer::add_due(const size_t npackets) {
+    _ndue += npackets;
+}
+
+size_t CircularBuffer::take_due() {
+    const size_t ndue = std::min(_ndue, slot_range());
+    _ndue = 0;
+    return ndue;
 }
 
 size_t CircularBuffer::range() const {
-    if (_tail <= _head)
-        return _head - _tail;
-    else
-        return _head + (rounded_cap() - _tail);
+    return slot_range() * _psize;
 }
 
 size_t CircularBuffer::psize() const {
@@ -174,11 +303,11 @@ size_t CircularBuffer::psize() const {
 }
 
 size_t CircularBuffer::tail() const {
-    return _tail;
+    return _tail * _psize;
 }
 
 size_t CircularBuffer::head() const {
-    return _head;
+    return _head * _psize;
 }
 
 char* CircularBuffer::data() const {
@@ -186,7 +315,28 @@ char* CircularBuffer::data() const {
 }
 
 bool CircularBuffer::occupied(const size_t idx) const {
-    return _occupied[idx];
+    return slot_occupied(idx / _psize);
+}
+
+void CircularBuffer::missing_ids(std::vector<uint64_t>& ids) const {
+    if (_empty)
+        return;
+    const size_t n = slot_range();
+    for (size_t off = find_slot(_tail, n, false); off < n;) {
+        ids.push_back(abs_tail() + off * _psize);
+        ++off;
+        off += find_slot(wrap(_tail + off), n - off, false);
+    }
+}
+
+const char* CircularBuffer::packet_at(const uint64_t first_byte_num) const {
+    if (_empty || first_byte_num < abs_tail() || first_byte_num >= _abs_head)
+        return nullptr;
+    uint64_t tail_offset = first_byte_num - abs_tail();
+    if (tail_offset % _psize != 0)
+        return nullptr;
+    size_t pos = wrap(_tail + tail_offset / _psize);
+    return slot_occupied(pos) ? at(pos) : nullptr;
 }
 
 uint64_t CircularBuffer::abs_head() const {
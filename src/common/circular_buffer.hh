@@ -12,10 +12,32 @@
  *
  * This buffer efficiently manages incoming audio packets, handling packet gaps and
  * ensuring proper ordering using a fixed-size memory allocation.
+ *
+ * Positions are kept in packet slots. If the number of slots is a power of two, they
+ * wrap around by masking; otherwise they fall back to a modulo.
+ *
+ * The per-packet paths are compiled for a few common packet sizes as well, so that
+ * copies and divisions by the packet size use a constant. `reset()` picks the variant.
+ *
+ * Where possible, the data lives in a memfd mapped twice in a row, so that any run of
+ * packets starting within the buffer is contiguous in memory, even if it wraps around.
+ * This needs the rounded capacity to be a multiple of the page size; otherwise (or if
+ * the mapping fails) runs crossing the end of the buffer are handled in two parts.
+ *
+ * Only the occupancy bitmap says which slots hold packets. The data of the other slots
+ * is stale and never cleared eagerly, not even on reset; it's zeroed just before being
+ * dumped as silence.
  */
 class CircularBuffer {
 public:
-    CircularBuffer(size_t capacity);
+    /**
+     * @brief Constructs an empty buffer.
+     * @param capacity Size of the buffer in bytes.
+     * @param reorder_window How many packets ahead of the next expected one a packet may be,
+     *        the lost ones in between being left as gaps. A packet further ahead isn't stored,
+     *        the buffer has to be reset from it. Clamped to one less than the number of slots.
+     */
+    CircularBuffer(size_t capacity, size_t reorder_window);
 
     ~CircularBuffer();
 
@@ -32,7 +54,7 @@ public:
     void reset(size_t psize, uint64_t abs_head);
 
     /**
-     * @brief Dumps a portion of the buffer to standard output.
+     * @brief Dumps a portion of the buffer to standard output, with silence in place of missing packets.
      * @param nbytes Number of bytes to dump.
      */
     void dump_tail(size_t nbytes);
@@ -40,12 +62,26 @@ public:
     /**
      * @brief Inserts an audio packet into the buffer.
      * @param packet The packet to insert.
+     * @return False if the packet is beyond the reorder window and wasn't stored - the buffer
+     *         has fallen out of sync with the stream and has to be reset from the packet.
      */
-    void try_put(const AudioPacket& packet);
+    bool try_put(const AudioPacket& packet);
 
     /// @return The number of continuous occupied packets from the tail.
     size_t cnt_upto_gap() const;
 
+    /**
+     * @brief Records packets as due for printing, for the printer to pick up.
+     * @param npackets Number of packets.
+     */
+    void add_due(size_t npackets);
+
+    /**
+     * @brief Takes the packets due for printing.
+     * @return Their number, at most the number of packets in the buffer.
+     */
+    size_t take_due();
+
     /// @return The number of bytes currently stored in the buffer.
     size_t range() const;
 
@@ -69,11 +105,24 @@ public:
 
     /**
      * @brief Checks if a specific buffer index is occupied.
-     * @param idx The index to check.
+     * @param idx The index to check, at a packet boundary.
      * @return True if occupied, false otherwise.
      */
     bool occupied(size_t idx) const;
 
+    /**
+     * @brief Collects the ids of the packets missing between the tail and the head.
+     * @param ids Filled with the first byte numbers of the missing packets, in order.
+     */
+    void missing_ids(std::vector<uint64_t>& ids) const;
+
+    /**
+     * @brief Looks up a received packet.
+     * @param first_byte_num The byte offset of the packet's first audio byte.
+     * @return Pointer to the packet's audio data, or nullptr if it isn't in the buffer.
+     */
+    const char* packet_at(uint64_t first_byte_num) const;
+
     /// @return The absolute head position of the buffer.
     uint64_t abs_head() const;
 
@@ -93,32 +142,113 @@ private:
     uint64_t _abs_head;  ///< Absolute head position of the buffer.
     uint64_t _byte0;     ///< The starting byte offset.
     size_t _capacity;    ///< Total capacity of the buffer.
+    size_t _reorder_window; ///< How many packets ahead of the head a packet may arrive, as requested.
+    size_t _window;      ///< `_reorder_window` clamped to fit the slots of the current packet size.
     size_t _psize;       ///< Size of a single packet.
-    size_t _tail;        ///< Tail index of the buffer.
-    size_t _head;        ///< Head index of the buffer.
+    size_t _nslots;      ///< Number of packet slots.
+    size_t _slot_mask;   ///< `_nslots - 1` if it's a power of two, 0 otherwise.
+    size_t _tail;        ///< Tail slot of the buffer.
+    size_t _head;        ///< Head slot of the buffer.
     char* _data;         ///< Pointer to the buffer data.
-    bool* _occupied;     ///< Array tracking occupied positions.
+    int _memfd;          ///< The memory `_data` is mapped from, -1 if it's allocated on the heap instead.
+    size_t _map_size;    ///< Size of the memfd, the capacity rounded up to pages.
+    size_t _mirror;      ///< Length of the data mapped a second time right after itself, 0 if none.
+    std::vector<uint64_t> _occupied; ///< One bit per packet slot, set if the slot holds a packet.
     bool _empty;         ///< Flag indicating if the buffer is empty.
+    size_t _ndue;        ///< Number of packets due for printing.
+
+    bool (CircularBuffer::*_put)(const AudioPacket&); ///< `put()` for the current packet size.
+    void (CircularBuffer::*_dump)(size_t);            ///< `dump()` for the current packet size.
 
     /// Enum to determine which side of the buffer an index belongs to.
     enum side { NONE, LEFT, RIGHT };
 
     /**
-     * @brief Determines which side an index belongs to in the buffer.
-     * @param idx The index to check.
+     * @brief Determines which side a slot belongs to in the buffer.
+     * @param slot The slot to check.
      * @return LEFT, RIGHT, or NONE.
      */
-    side sideof(size_t idx) const;
+    side sideof(size_t slot) const;
+
+    /**
+     * @brief Maps a memfd for the buffer data, with address space reserved for a second copy.
+     * @return False if memfd mappings aren't available.
+     */
+    bool map_data();
+
+    /**
+     * @brief Maps the start of the buffer data a second time right after itself, if possible.
+     * @param len Length of the part mirrored, the rounded capacity.
+     * @throws Calls `fatal()` if the data can't be mapped at all anymore.
+     */
+    void mirror(size_t len);
+
+    /**
+     * @brief Wraps a slot position around the end of the buffer.
+     * @param slot The position.
+     * @return The slot.
+     */
+    size_t wrap(size_t slot) const;
+
+    /// @return Pointer to the audio data of a slot.
+    char* at(size_t slot) const;
+
+    /// @return The number of slots between the tail and the head.
+    size_t slot_range() const;
+
+    /// @return True if the slot holds a packet.
+    bool slot_occupied(size_t slot) const;
+
+    /// @brief Marks a slot as occupied.
+    void set_occupied(size_t slot);
+
+    /**
+     * @brief Marks a run of slots as free.
+     * @param slot The first slot.
+     * @param n Length of the run, in slots. May wrap around.
+     */
+    void clear_occupied(size_t slot, size_t n);
+
+    /**
+     * @brief Finds the first slot with a given occupancy, a word of the bitmap at a time.
+     * @param from The slot to start from.
+     * @param n Number of slots to look through, wrapping around the end of the buffer.
+     * @param value The occupancy looked for.
+     * @return The distance from `from` to the slot found, in slots, or `n` if there's none.
+     */
+    size_t find_slot(size_t from, size_t n, bool value) const;
+
+    /**
+     * @brief Inserts an audio packet into the buffer.
+     * @tparam PSIZE The packet size, or 0 for the runtime one.
+     * @param packet The packet to insert.
+     * @return False if the packet is beyond the reorder window and wasn't stored.
+     */
+    template <size_t PSIZE>
+    bool put(const AudioPacket& packet);
+
+    /**
+     * @brief Dumps a portion of the buffer to standard output.
+     * @tparam PSIZE The packet size, or 0 for the runtime one.
+     * @param nbytes Number of bytes to dump.
+     */
+    template <size_t PSIZE>
+    void dump(size_t nbytes);
 
     /**
      * @brief Fills gaps in the buffer with a missing packet.
+     * @tparam PSIZE The packet size, or 0 for the runtime one.
      * @param packet The packet to fill the gap.
      */
+    template <size_t PSIZE>
     void fill_gap(const AudioPacket& packet);
 
     /**
      * @brief Attempts to push an audio packet to the head of the buffer.
+     * @tparam PSIZE The packet size, or 0 for the runtime one.
      * @param packet The packet to insert.
+     * @return False if the packet is beyond the reorder window and wasn't stored.
      */
-    void try_push_head(const AudioPacket& packet);
+    template <size_t PSIZE>
+    bool try_push_head(const AudioPacket& packet);
 };
\ No newline at end of file
@@ -6,113 +6,173 @@
 #include "except.hh"
 
 #include <cctype>
+#include <cstring>
 
-#include <sstream>
+#include <charconv>
 #include <algorithm>
-#include <iterator>
 
 #define FIELD_SEPARATOR  ' '
-#define PACKET_SEPARATOR ","
+#define PACKET_SEPARATOR ','
 
-static inline std::string trimmed(std::string str) {
+static inline std::string_view trimmed(std::string_view str) {
     if (!str.empty() && str.back() == '\n')
-        str.pop_back();
+        str.remove_suffix(1);
     return str;
 }
 
-/// Checks if a string consists only of numeric characters.
-static inline bool is_numeric(const std::string& str) {
-    return std::all_of(str.begin(), str.end(), std::isdigit);
+/// Parses a whole string as an unsigned number, rejecting anything but digits.
+template <typename T>
+static inline bool parse_number(const std::string_view str, T& value) {
+    if (str.empty())
+        return false;
+    auto [ptr, ec] = std::from_chars(str.data(), str.data() + str.size(), value);
+    return ec == std::errc() && ptr == str.data() + str.size();
+}
+
+/// Appends a string to a buffer, if it fits.
+static inline bool append(char*& pos, const char* end, const std::string_view str) {
+    if ((size_t)(end - pos) < str.size())
+        return false;
+    memcpy(pos, str.data(), str.size());
+    pos += str.size();
+    return true;
+}
+
+/// Appends a number to a buffer, if it fits.
+static inline bool append(char*& pos, const char* end, const uint64_t value) {
+    auto [ptr, ec] = std::to_chars(pos, (char*)end, value);
+    if (ec != std::errc())
+        return false;
+    pos = ptr;
+    return true;
 }
 
 //----------------------------LookupRequest------------------------------------
 
 LookupRequest::LookupRequest(const std::string& str) {
-    if (trimmed(str) != LookupRequest::prefix)
+    if (!is_valid(str))
         throw RadioException("Invalid prefix");
 }
 
+bool LookupRequest::is_valid(const std::string_view str) {
+    return trimmed(str) == LookupRequest::prefix;
+}
+
+size_t LookupRequest::to_buf(char* buf, const size_t size) const {
+    char* pos = buf;
+    if (!append(pos, buf + size, LookupRequest::prefix) || !append(pos, buf + size, "\n"))
+        return 0;
+    return pos - buf;
+}
+
 std::string LookupRequest::to_str() const {
     return LookupRequest::prefix + '\n';
 }
 
 //----------------------------LookupReply------------------------------------
 
-// note to self: parsing would've been better with strtok...
-
-LookupReply::LookupReply(const std::string& str) {
-    std::string input = trimmed(str);
+const char* LookupReply::parse(const std::string_view str, std::string_view& mcast_addr, in_port_t& data_port, std::string_view& name) {
+    std::string_view input = trimmed(str);
 
     // prefix
     size_t space_pos = input.find(FIELD_SEPARATOR);
     if (space_pos != LookupReply::prefix.length())
-        throw RadioException("Invalid format");
+        return "Invalid format";
     if (input.substr(0, space_pos) != LookupReply::prefix)
-        throw RadioException("Invalid prefix");
-    input = input.substr(space_pos + 1);
+        return "Invalid prefix";
+    input.remove_prefix(space_pos + 1);
 
     // mcast_addr
     space_pos = input.find(FIELD_SEPARATOR);
-    if (space_pos == std::string::npos)
-        throw RadioException("Invalid format");
+    if (space_pos == std::string_view::npos)
+        return "Invalid format";
     mcast_addr = input.substr(0, space_pos);
-    input = input.substr(space_pos + 1);
+    input.remove_prefix(space_pos + 1);
 
     // data_port
     space_pos = input.find(FIELD_SEPARATOR);
-    if (space_pos == std::string::npos)
-        throw RadioException("Invalid format");
-    unsigned long value = std::stoul(input.substr(0, space_pos));
-    if (value > std::numeric_limits<uint16_t>::max())
-        throw RadioException("Invalid data_port");
-    data_port = static_cast<uint16_t>(value);
-    if (!get_mcast_addr(mcast_addr.c_str(), data_port))
-        throw RadioException("Invalid mcast_addr");
-    input = input.substr(space_pos + 1);
+    if (space_pos == std::string_view::npos)
+        return "Invalid format";
+    if (!parse_number(input.substr(0, space_pos), data_port))
+        return "Invalid data_port";
+    char addr_buf[ADDR_MAX_LEN + 1] = {0};
+    if (mcast_addr.size() > ADDR_MAX_LEN)
+        return "Invalid mcast_addr";
+    memcpy(addr_buf, mcast_addr.data(), mcast_addr.size());
+    if (!get_mcast_addr(addr_buf, data_port))
+        return "Invalid mcast_addr";
+    input.remove_prefix(space_pos + 1);
 
     // name
     name = input;
     if (!RadioStation::is_valid_name(name))
-        throw RadioException("Invalid name");
+        return "Invalid name";
+    return nullptr;
+}
+
+LookupReply::LookupReply(const std::string& str) {
+    std::string_view mcast_addr_view, name_view;
+    if (const char* err = parse(str, mcast_addr_view, data_port, name_view))
+        throw RadioException(err);
+    mcast_addr = mcast_addr_view;
+    name       = name_view;
 }
 
 LookupReply::LookupReply(const std::string& mcast_addr, const in_port_t data_port, const std::string& name)
     : mcast_addr(mcast_addr), data_port(data_port), name(name) {}
 
+size_t LookupReply::to_buf(char* buf, const size_t size) const {
+    const char* end = buf + size;
+    char* pos = buf;
+    bool fits =
+        append(pos, end, LookupReply::prefix) && append(pos, end, " ") &&
+        append(pos, end, mcast_addr) && append(pos, end, " ") &&
+        append(pos, end, data_port) && append(pos, end, " ") &&
+        append(pos, end, name) && append(pos, end, "\n");
+    return fits ? pos - buf : 0;
+}
+
 std::string LookupReply::to_str() const {
-    return
-        LookupReply::prefix + FIELD_SEPARATOR +
-        mcast_addr + FIELD_SEPARATOR +
-        std::to_string(data_port) + FIELD_SEPARATOR +
-        name + '\n';
+    std::string str(LookupReply::prefix.size() + ADDR_MAX_LEN + STATION_NAME_MAX_LEN + 16, '\0');
+    str.resize(to_buf(str.data(), str.size()));
+    return str;
 }
 
 //----------------------------RexmitRequest------------------------------------
 
-RexmitRequest::RexmitRequest(const sockaddr_in& receiver_addr, const std::string& str)
-    : receiver_addr(receiver_addr)
-{
-    std::string input = trimmed(str);
+const char* RexmitRequest::parse(const std::string_view str, std::vector<uint64_t>& packet_ids) {
+    std::string_view input = trimmed(str);
 
-    if (!isdigit(input.back()) && input.back() != FIELD_SEPARATOR)
-        throw RadioException("Invalid last character");
+    if (input.empty() || (!isdigit((unsigned char)input.back()) && input.back() != FIELD_SEPARATOR))
+        return "Invalid last character";
 
     // prefix
     size_t space_pos = input.find(FIELD_SEPARATOR);
     if (space_pos != RexmitRequest::prefix.length())
-        throw RadioException("Invalid format");
+        return "Invalid format";
     if (input.substr(0, space_pos) != RexmitRequest::prefix)
-        throw RadioException("Invalid prefix");
+        return "Invalid prefix";
 
     // packet ids
-    input = input.substr(space_pos + 1);
-    std::istringstream ss(input);
-    std::string token;
-    while (std::getline(ss, token, *PACKET_SEPARATOR)) {
-        if (!is_numeric(token))
-            throw RadioException("Invalid packet ids");
-        packet_ids.push_back(std::stoull(token));
+    input.remove_prefix(space_pos + 1);
+    while (!input.empty()) {
+        size_t sep_pos = input.find(PACKET_SEPARATOR);
+        uint64_t id;
+        if (!parse_number(input.substr(0, sep_pos), id))
+            return "Invalid packet ids";
+        packet_ids.push_back(id);
+        if (sep_pos == std::string_view::npos)
+            break;
+        input.remove_prefix(sep_pos + 1);
     }
+    return nullptr;
+}
+
+RexmitRequest::RexmitRequest(const sockaddr_in& receiver_addr, const std::string& str)
+    : receiver_addr(receiver_addr)
+{
+    if (const char* err = parse(str, packet_ids))
+        throw RadioException(err);
 }
 
 RexmitRequest::RexmitRequest(RexmitRequest&& other)
@@ -125,19 +185,28 @@ RexmitRequest::RexmitRequest(const sockaddr_in& receiver_addr, const std::vector
     , packet_ids(packet_ids)
     {}
 
-std::string RexmitRequest::to_str() const {
-    std::ostringstream oss;
-    // prefix
-    oss << RexmitRequest::prefix << FIELD_SEPARATOR;
+size_t RexmitRequest::write(const std::span<const uint64_t> packet_ids, char* buf, const size_t size) {
+    const char* end = buf + size;
+    char* pos = buf;
+    if (!append(pos, end, RexmitRequest::prefix) || !append(pos, end, " "))
+        return 0;
+    for (size_t i = 0; i < packet_ids.size(); ++i)
+        if ((i > 0 && !append(pos, end, ",")) || !append(pos, end, packet_ids[i]))
+            return 0;
+    if (!append(pos, end, "\n"))
+        return 0;
+    return pos - buf;
+}
 
-    // packet_ids
-    if (!packet_ids.empty()) {
-        oss << packet_ids.front();
-        for (size_t i = 1; i < packet_ids.size(); ++i)
-            oss << PACKET_SEPARATOR << packet_ids[i];
-    }
-    oss << '\n';
-    return oss.str();
+size_t RexmitRequest::to_buf(char* buf, const size_t size) const {
+    return write(packet_ids, buf, size);
+}
+
+std::string RexmitRequest::to_str() const {
+    // every id takes at most 20 digits and a separator
+    std::string str(RexmitRequest::prefix.size() + 2 + packet_ids.size() * 21, '\0');
+    str.resize(to_buf(str.data(), str.size()));
+    return str;
 }
 
 //----------------------------AudioPacket------------------------------------
@@ -175,3 +244,14 @@ AudioPacket::AudioPacket(AudioPacket&& other)
 const char* AudioPacket::audio_data() const {
     return bytes.get() + 2 * sizeof(uint64_t);
 }
+
+//----------------------------classification------------------------------------
+
+DatagramType classify_request(const std::string_view str) {
+    // the prefixes differ in their first character, so a mismatch is detected right away
+    if (str.starts_with(LookupRequest::prefix))
+        return DatagramType::LookupRequest;
+    if (str.starts_with(RexmitRequest::prefix))
+        return DatagramType::RexmitRequest;
+    return DatagramType::None;
+}
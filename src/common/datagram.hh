@@ -8,8 +8,10 @@
 #include <cstddef>
 
 #include <string>
+#include <string_view>
 #include <memory>
 #include <vector>
+#include <span>
 
 /// Computes the total packet size, including session ID and byte offset headers.
 #define TOTAL_PSIZE(psize) ((psize) + 2 * sizeof(uint64_t))
@@ -30,6 +32,21 @@ struct LookupRequest {
 
     LookupRequest() = default;
 
+    /**
+     * @brief Checks whether a string is a valid lookup request, without throwing.
+     * @param str The received string.
+     * @return True if `str` is a lookup request.
+     */
+    static bool is_valid(std::string_view str);
+
+    /**
+     * @brief Serializes the request into a caller-supplied buffer.
+     * @param buf The buffer to write to.
+     * @param size Size of the buffer.
+     * @return The length of the serialized request, or 0 if it doesn't fit.
+     */
+    size_t to_buf(char* buf, size_t size) const;
+
     /**
      * @brief Serializes the request to a string.
      * @return The serialized lookup request.
@@ -63,6 +80,24 @@ struct LookupReply {
      */
     LookupReply(const std::string& mcast_addr, in_port_t data_port, const std::string& name);
 
+    /**
+     * @brief Parses a lookup reply without allocating or throwing.
+     * @param str The received lookup reply string.
+     * @param mcast_addr Set to the multicast address, pointing into `str`.
+     * @param data_port Set to the data port.
+     * @param name Set to the station name, pointing into `str`.
+     * @return `nullptr` on success, otherwise a description of the error.
+     */
+    static const char* parse(std::string_view str, std::string_view& mcast_addr, in_port_t& data_port, std::string_view& name);
+
+    /**
+     * @brief Serializes the reply into a caller-supplied buffer.
+     * @param buf The buffer to write to.
+     * @param size Size of the buffer.
+     * @return The length of the serialized reply, or 0 if it doesn't fit.
+     */
+    size_t to_buf(char* buf, size_t size) const;
+
     /**
      * @brief Serializes the reply to a string.
      * @return The serialized lookup reply.
@@ -98,6 +133,33 @@ struct RexmitRequest {
     /// Move constructor.
     RexmitRequest(RexmitRequest&& other);
 
+    /**
+     * @brief Parses a retransmission request without throwing.
+     *
+     * Doesn't allocate, as long as `packet_ids` has enough capacity reserved.
+     * @param str The received retransmission request string.
+     * @param packet_ids The vector to append the requested packet IDs to.
+     * @return `nullptr` on success, otherwise a description of the error.
+     */
+    static const char* parse(std::string_view str, std::vector<uint64_t>& packet_ids);
+
+    /**
+     * @brief Serializes a request for the given packets into a caller-supplied buffer.
+     * @param packet_ids List of missing packet IDs.
+     * @param buf The buffer to write to.
+     * @param size Size of the buffer.
+     * @return The length of the serialized request, or 0 if it doesn't fit.
+     */
+    static size_t write(std::span<const uint64_t> packet_ids, char* buf, size_t size);
+
+    /**
+     * @brief Serializes the request into a caller-supplied buffer.
+     * @param buf The buffer to write to.
+     * @param size Size of the buffer.
+     * @return The length of the serialized request, or 0 if it doesn't fit.
+     */
+    size_t to_buf(char* buf, size_t size) const;
+
     /**
      * @brief Serializes the request to a string.
      * @return The serialized retransmission request.
@@ -154,4 +216,13 @@ enum class DatagramType {
     LookupReply,    ///< Lookup reply datagram.
     RexmitRequest,  ///< Retransmission request datagram.
     AudioPacket,    ///< Audio data packet.
-};
\ No newline at end of file
+};
+
+/**
+ * @brief Classifies a control datagram by its prefix alone, in a single pass and without throwing.
+ *
+ * The datagram isn't validated beyond its prefix - it still needs to be parsed.
+ * @param str The received datagram.
+ * @return `DatagramType::LookupRequest`, `DatagramType::RexmitRequest` or `DatagramType::None`.
+ */
+DatagramType classify_request(std::string_view str);
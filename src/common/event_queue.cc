@@ -2,33 +2,99 @@
 
 #include "log.hh"
 #include <unistd.h>
+#include <sys/eventfd.h>
+#include <sched.h>
+
+#include <cstdint>
 
 #include "../common/synced_ptr.hh"
 #include "../common/worker.hh"
 
-EventQueue::EventQueue() {
-    if (pipe(_fds)) == -1)
-        fatal("pipe");
+EventQueue::EventQueue()
+: _cells(std::make_unique<Cell[]>(CAPACITY)), _tail(0), _head(0), _signalled(false), _terminated(false) {
+    for (size_t i = 0; i < CAPACITY; ++i)
+        _cells[i].seq.store(i, std::memory_order_relaxed);
+    if ((_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1)
+        fatal("eventfd");
 }
 
 EventQueue::~EventQueue() {
-    for (auto i : {STDIN_FILENO, STDOUT_FILENO})
-        if (close(_fds[i])) == -1)
-            fatal("close");
+    if (close(_fd) == -1)
+        fatal("close");
 }
 
 int EventQueue::in_fd() const {
-    return _fds[STDIN_FILENO];
+    return _fd;
+}
+
+void EventQueue::signal() {
+    // only the producer that flips the flag writes, the others find the consumer signalled already
+    if (_signalled.exchange(true))
+        return;
+    uint64_t one = 1;
+    if (write(_fd, &one, sizeof one) == -1)
+        fatal("write");
 }
 
 void EventQueue::push(const EventQueue::EventType event_type) {
-    if (write(_fds[STDOUT_FILENO], &event_type, sizeof(event_type))) == -1)
+    size_t pos = _tail.load(std::memory_order_relaxed);
+    for (;;) {
+        Cell& cell = _cells[pos & (CAPACITY - 1)];
+        size_t seq = cell.seq.load(std::memory_order_acquire);
+        intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+        if (diff == 0) {
+            if (_tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                cell.event = static_cast<int>(event_type);
+                cell.seq.store(pos + 1); // seq_cst, pairs with the recheck in pop()
+                break;
+            }
+        } else if (diff < 0) {
+            // full: let the consumer catch up, it's been signalled about the queued events
+            sched_yield();
+            pos = _tail.load(std::memory_order_relaxed);
+        } else {
+            pos = _tail.load(std::memory_order_relaxed);
+        }
+    }
+    signal();
+}
+
+void EventQueue::terminate() {
+    _terminated.store(true);
+    // bypasses the flag, the eventfd just has to end up readable; write() is async-signal-safe
+    uint64_t one = 1;
+    if (write(_fd, &one, sizeof one) == -1)
         fatal("write");
 }
 
-EventQueue::EventType EventQueue::pop() const {
-    EventQueue::EventType event_type;
-    if (read(_fds[STDIN_FILENO], &event_type, sizeof(event_type))) == -1)
+bool EventQueue::try_pop(int& event) {
+    Cell& cell = _cells[_head & (CAPACITY - 1)];
+    if (cell.seq.load(std::memory_order_acquire) != _head + 1)
+        return false;
+    event = cell.event;
+    cell.seq.store(_head + CAPACITY, std::memory_order_release);
+    ++_head;
+    return true;
+}
+
+EventQueue::EventType EventQueue::pop() {
+    if (_terminated.load())
+        return EventType::TERMINATE; // the eventfd stays readable, so it's never missed
+    int event;
+    bool popped = try_pop(event);
+
+    Cell& next = _cells[_head & (CAPACITY - 1)];
+    if (next.seq.load(std::memory_order_acquire) == _head + 1)
+        return popped ? static_cast<EventType>(event) : EventType::NONE; // stay readable
+
+    // drained: consume the signal, then check again for an event pushed meanwhile, whose
+    // producer may have seen the flag still set and skipped the write
+    uint64_t count;
+    if (read(_fd, &count, sizeof count) == -1 && errno != EAGAIN)
         fatal("read");
-    return event_type;
+    _signalled.store(false);
+    if (next.seq.load() == _head + 1)
+        signal();
+
+    return popped ? static_cast<EventType>(event) : EventType::NONE;
 }
@@ -5,27 +5,50 @@
 
 #include <unistd.h>
 
+#include <atomic>
+#include <cstddef>
+#include <memory>
+
 /**
  * @class EventQueue
- * @brief Implements a lightweight inter-thread or inter-process event queue.
+ * @brief Implements a lightweight inter-thread event queue.
+ *
+ * Events are kept in a bounded, lock-free ring with many producers and a single consumer,
+ * and are popped in a FIFO manner. An **eventfd** is readable whenever the ring may hold
+ * events, so the consumer can still `poll()` on `in_fd()` along with its sockets.
  *
- * This class wraps a simple **pipe-based event queue** to facilitate **event-driven communication**.
- * Events can be pushed into the queue and later popped in a FIFO manner.
+ * The eventfd is only written to when the consumer isn't signalled yet, so pushing onto
+ * a queue whose consumer is already awake (has events pending) costs no syscall.
  */
 struct EventQueue {
 private:
-    int _fds[2]; ///< File descriptors for the read (0) and write (1) ends of the pipe.
+    struct Cell {
+        std::atomic<size_t> seq;
+        int event;
+    };
+
+    static constexpr size_t CAPACITY = 1024; ///< Number of events the ring holds, a power of two.
+
+    int _fd;                                 ///< The eventfd the consumer polls on.
+    std::unique_ptr<Cell[]> _cells;
+    alignas(64) std::atomic<size_t> _tail;   ///< Position of the next push.
+    alignas(64) size_t _head;                ///< Position of the next pop.
+    std::atomic<bool> _signalled;            ///< Whether the eventfd has been written to and not read since.
+    std::atomic<bool> _terminated;           ///< Whether `terminate()` was called; outranks any queued event.
+
+    bool try_pop(int& event);
+    void signal();
 
 public:
     /**
-     * @brief Constructs an `EventQueue` and initializes a pipe.
-     * @throws Calls `fatal()` if the pipe cannot be created.
+     * @brief Constructs an `EventQueue` and initializes an eventfd.
+     * @throws Calls `fatal()` if the eventfd cannot be created.
      */
     EventQueue();
 
     /**
-     * @brief Destructor that closes both ends of the pipe.
-     * @throws Calls `fatal()` if closing the pipe fails.
+     * @brief Destructor that closes the eventfd.
+     * @throws Calls `fatal()` if closing the eventfd fails.
      */
     ~EventQueue();
 
@@ -40,25 +63,37 @@ public:
         CLIENT_ADDED,            ///< A new client has connected.
         NEW_JOBS,                ///< Indicates that new jobs have been queued.
         TERMINATE,               ///< Signals termination of the event loop.
+        NONE,                    ///< Nothing to pop, the wakeup was spurious.
     };
 
     /**
      * @brief Retrieves the file descriptor for reading events.
-     * @return The read-end file descriptor of the queue.
+     * @return The eventfd, readable while there are events to pop.
      */
     int in_fd() const;
 
     /**
-     * @brief Pushes an event into the queue.
+     * @brief Pushes an event into the queue. Safe to call from many threads at once.
+     *
+     * If the ring is full, waits for the consumer to make room, like a write to a full pipe would.
      * @param event_type The event type to push.
-     * @throws Calls `fatal()` if writing to the queue fails.
+     * @throws Calls `fatal()` if signalling the eventfd fails.
      */
     void push(EventType event_type);
 
     /**
-     * @brief Pops an event from the queue.
-     * @return The event type that was retrieved.
-     * @throws Calls `fatal()` if reading from the queue fails.
+     * @brief Makes every following `pop()` return `TERMINATE`. Async-signal-safe.
+     *
+     * Unlike `push()`, never waits for room in the ring, so it can't hang a signal handler
+     * that interrupted the consumer of a full queue.
+     * @throws Calls `fatal()` if signalling the eventfd fails.
+     */
+    void terminate();
+
+    /**
+     * @brief Pops an event from the queue. Consumer only.
+     * @return The event type that was retrieved, or `NONE` if there was none.
+     * @throws Calls `fatal()` if reading the eventfd fails.
      */
-    EventType pop() const;
-};
\ No newline at end of file
+    EventType pop();
+};
@@ -0,0 +1,51 @@
+#include "fec.hh"
+
+#include "endian.hh"
+
+#include <cstring>
+
+void ParityHeader::write(char* buf) const {
+    uint64_t val64 = htonll(session_id);
+    memcpy(buf, &val64, sizeof(val64));
+    val64 = htonll(group_byte_num);
+    memcpy(buf + sizeof(val64), &val64, sizeof(val64));
+    uint16_t val16[4] = {htons(ndata), htons(nparity), htons(index), 0};
+    memcpy(buf + 2 * sizeof(val64), val16, sizeof(val16));
+}
+
+bool ParityHeader::parse(const char* buf, const size_t nbytes, ParityHeader& header) {
+    if (nbytes <= SIZE)
+        return false;
+    uint64_t val64;
+    memcpy(&val64, buf, sizeof(val64));
+    header.session_id = ntohll(val64);
+    memcpy(&val64, buf + sizeof(val64), sizeof(val64));
+    header.group_byte_num = ntohll(val64);
+    uint16_t val16[4];
+    memcpy(val16, buf + 2 * sizeof(val64), sizeof(val16));
+    header.ndata   = ntohs(val16[0]);
+    header.nparity = ntohs(val16[1]);
+    header.index   = ntohs(val16[2]);
+    return header.nparity > 0 && header.index < header.nparity && header.nparity <= header.ndata;
+}
+
+uint64_t ParityHeader::covered(const size_t i, const size_t psize) const {
+    size_t packet_no = index + i * nparity;
+    if (packet_no >= ndata)
+        return UINT64_MAX;
+    return group_byte_num + packet_no * psize;
+}
+
+void xor_bytes(char* dst, const char* src, const size_t nbytes) {
+    // memcpy keeps the word accesses free of alignment and aliasing issues, the compiler vectorizes the loop
+    size_t i = 0;
+    for (; i + sizeof(uint64_t) <= nbytes; i += sizeof(uint64_t)) {
+        uint64_t a, b;
+        memcpy(&a, dst + i, sizeof(a));
+        memcpy(&b, src + i, sizeof(b));
+        a ^= b;
+        memcpy(dst + i, &a, sizeof(a));
+    }
+    for (; i < nbytes; ++i)
+        dst[i] ^= src[i];
+}
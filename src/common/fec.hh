@@ -0,0 +1,58 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+
+/**
+ * @struct ParityHeader
+ * @brief The header of a forward error correction parity packet.
+ *
+ * Audio packets are grouped by `ndata`, starting from the packet at byte 0. Every
+ * group is followed by `nparity` parity packets, the j-th one being the XOR of the
+ * group's data packets j, j + nparity, j + 2 * nparity, ... - interleaving the parity
+ * this way lets a group recover from a burst of up to `nparity` consecutive losses.
+ *
+ * Parity packets go to DATA_PORT + 1 of the station's multicast address, so receivers
+ * that don't know about them never see them.
+ */
+struct ParityHeader {
+    uint64_t session_id;     ///< Session identifier of the covered packets.
+    uint64_t group_byte_num; ///< Byte offset of the group's first data packet.
+    uint16_t ndata;          ///< Number of data packets in a group.
+    uint16_t nparity;        ///< Number of parity packets per group.
+    uint16_t index;          ///< Index of this parity packet within the group.
+
+    /// Size of the serialized header, preceding the parity bytes.
+    inline static constexpr size_t SIZE = 2 * sizeof(uint64_t) + 4 * sizeof(uint16_t);
+
+    /**
+     * @brief Serializes the header.
+     * @param buf Buffer of at least `SIZE` bytes.
+     */
+    void write(char* buf) const;
+
+    /**
+     * @brief Parses a header, without throwing.
+     * @param buf The received datagram.
+     * @param nbytes Length of the datagram.
+     * @param header The parsed header.
+     * @return True if the datagram is a well-formed parity packet.
+     */
+    static bool parse(const char* buf, size_t nbytes, ParityHeader& header);
+
+    /**
+     * @brief Computes the byte offset of a data packet covered by this parity packet.
+     * @param i Which of the covered packets, counting from 0.
+     * @param psize Size of an audio packet's payload.
+     * @return The byte offset, or `UINT64_MAX` if this parity covers fewer packets.
+     */
+    uint64_t covered(size_t i, size_t psize) const;
+};
+
+/**
+ * @brief XORs `src` into `dst`, a machine word at a time.
+ * @param dst The buffer XORed into.
+ * @param src The buffer XORed with.
+ * @param nbytes Length of both buffers.
+ */
+void xor_bytes(char* dst, const char* src, size_t nbytes);
@@ -0,0 +1,227 @@
+#include "io_uring.hh"
+
+#include "log.hh"
+
+#include <unistd.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <cstring>
+
+#include <atomic>
+#include <algorithm>
+
+static int io_uring_setup(unsigned entries, io_uring_params* params) {
+    return syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+    return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, nullptr, 0);
+}
+
+static int io_uring_register(int fd, unsigned opcode, void* arg, unsigned nr_args) {
+    return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static unsigned load_acquire(unsigned* p) {
+    return std::atomic_ref<unsigned>(*p).load(std::memory_order_acquire);
+}
+
+static void store_release(unsigned* p, unsigned val) {
+    std::atomic_ref<unsigned>(*p).store(val, std::memory_order_release);
+}
+
+bool parse_io_backend(const std::string& name, IoBackend& backend) {
+    if (name == "poll")
+        backend = IoBackend::POLL;
+    else if (name == "io_uring")
+        backend = IoBackend::IO_URING;
+    else
+        return false;
+    return true;
+}
+
+IoUring::IoUring()
+    : _fd(-1)
+    , _sq_ring(MAP_FAILED)
+    , _sq_ring_size(0)
+    , _cq_ring(MAP_FAILED)
+    , _cq_ring_size(0)
+    , _sqes((io_uring_sqe*)MAP_FAILED)
+    , _sqes_size(0)
+    , _nqueued(0)
+    , _buf_ring((io_uring_buf_ring*)MAP_FAILED)
+    , _bufs(nullptr)
+    , _nbufs(0)
+    , _buf_size(0)
+    {}
+
+std::unique_ptr<IoUring> IoUring::create(const unsigned entries) {
+    std::unique_ptr<IoUring> ring(new IoUring());
+    io_uring_params params = {};
+    if ((ring->_fd = io_uring_setup(entries, &params)) == -1)
+        return nullptr;
+
+    ring->_sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->_cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+        ring->_sq_ring_size = ring->_cq_ring_size = std::max(ring->_sq_ring_size, ring->_cq_ring_size);
+
+    ring->_sq_ring = mmap(nullptr, ring->_sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                          ring->_fd, IORING_OFF_SQ_RING);
+    if (ring->_sq_ring == MAP_FAILED)
+        return nullptr;
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+        ring->_cq_ring = ring->_sq_ring;
+    else {
+        ring->_cq_ring = mmap(nullptr, ring->_cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                              ring->_fd, IORING_OFF_CQ_RING);
+        if (ring->_cq_ring == MAP_FAILED)
+            return nullptr;
+    }
+    ring->_sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+    ring->_sqes = (io_uring_sqe*)mmap(nullptr, ring->_sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                                      ring->_fd, IORING_OFF_SQES);
+    if (ring->_sqes == MAP_FAILED)
+        return nullptr;
+
+    char* sq = (char*)ring->_sq_ring;
+    char* cq = (char*)ring->_cq_ring;
+    ring->_sq_head    = (unsigned*)(sq + params.sq_off.head);
+    ring->_sq_tail    = (unsigned*)(sq + params.sq_off.tail);
+    ring->_sq_array   = (unsigned*)(sq + params.sq_off.array);
+    ring->_sq_mask    = *(unsigned*)(sq + params.sq_off.ring_mask);
+    ring->_sq_entries = params.sq_entries;
+    ring->_cq_head    = (unsigned*)(cq + params.cq_off.head);
+    ring->_cq_tail    = (unsigned*)(cq + params.cq_off.tail);
+    ring->_cqes       = (io_uring_cqe*)(cq + params.cq_off.cqes);
+    ring->_cq_mask    = *(unsigned*)(cq + params.cq_off.ring_mask);
+    return ring;
+}
+
+IoUring::~IoUring() {
+    if (_buf_ring != MAP_FAILED)
+        munmap(_buf_ring, _nbufs * sizeof(io_uring_buf));
+    delete[] _bufs;
+    if (_sqes != MAP_FAILED)
+        munmap(_sqes, _sqes_size);
+    if (_cq_ring != MAP_FAILED && _cq_ring != _sq_ring)
+        munmap(_cq_ring, _cq_ring_size);
+    if (_sq_ring != MAP_FAILED)
+        munmap(_sq_ring, _sq_ring_size);
+    if (_fd != -1 && close(_fd) == -1)
+        fatal("close");
+}
+
+bool IoUring::register_buffers(const unsigned nbufs, const size_t buf_size) {
+    _buf_ring = (io_uring_buf_ring*)mmap(nullptr, nbufs * sizeof(io_uring_buf), PROT_READ | PROT_WRITE,
+                                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (_buf_ring == MAP_FAILED)
+        fatal("mmap");
+    _nbufs = nbufs;
+
+    io_uring_buf_reg reg = {};
+    reg.ring_addr    = (uint64_t)_buf_ring;
+    reg.ring_entries = nbufs;
+    reg.bgid         = BUFFER_GROUP;
+    if (io_uring_register(_fd, IORING_REGISTER_PBUF_RING, &reg, 1) == -1)
+        return false;
+
+    _buf_size = buf_size;
+    _bufs     = new char[nbufs * buf_size];
+    for (unsigned i = 0; i < nbufs; ++i)
+        recycle(i);
+    return true;
+}
+
+char* IoUring::buffer(const uint16_t bid) const {
+    return _bufs + bid * _buf_size;
+}
+
+void IoUring::recycle(const uint16_t bid) {
+    // the tail overlays the first buffer's reserved field, so it's only ever touched through atomics
+    std::atomic_ref<uint16_t> tail(_buf_ring->tail);
+    uint16_t pos = tail.load(std::memory_order_relaxed);
+    // not `_buf_ring->bufs`, which C++ compilers lay out past an empty struct, unlike the kernel
+    io_uring_buf& buf = reinterpret_cast<io_uring_buf*>(_buf_ring)[pos & (_nbufs - 1)];
+    buf.addr = (uint64_t)buffer(bid);
+    buf.len  = _buf_size;
+    buf.bid  = bid;
+    tail.store(pos + 1, std::memory_order_release);
+}
+
+io_uring_sqe* IoUring::get_sqe() {
+    unsigned tail = *_sq_tail + _nqueued;
+    if (tail - load_acquire(_sq_head) == _sq_entries) {
+        submit();
+        tail = *_sq_tail;
+    }
+    io_uring_sqe* sqe = &_sqes[tail & _sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    _sq_array[tail & _sq_mask] = tail & _sq_mask;
+    _nqueued++;
+    return sqe;
+}
+
+void IoUring::prep_poll_multishot(const int fd, const uint64_t user_data) {
+    io_uring_sqe* sqe   = get_sqe();
+    sqe->opcode         = IORING_OP_POLL_ADD;
+    sqe->fd             = fd;
+    sqe->poll32_events  = POLLIN;
+    sqe->len            = IORING_POLL_ADD_MULTI;
+    sqe->user_data      = user_data;
+}
+
+void IoUring::prep_recv_multishot(const int fd, const uint64_t user_data) {
+    io_uring_sqe* sqe = get_sqe();
+    sqe->opcode       = IORING_OP_RECV;
+    sqe->fd           = fd;
+    sqe->ioprio       = IORING_RECV_MULTISHOT;
+    sqe->flags        = IOSQE_BUFFER_SELECT;
+    sqe->buf_group    = BUFFER_GROUP;
+    sqe->user_data    = user_data;
+}
+
+void IoUring::prep_sendmsg(const int fd, const msghdr* msg, const uint64_t user_data, const bool link) {
+    io_uring_sqe* sqe = get_sqe();
+    sqe->opcode       = IORING_OP_SENDMSG;
+    sqe->fd           = fd;
+    sqe->addr         = (uint64_t)msg;
+    sqe->len          = 1;
+    sqe->flags        = link ? IOSQE_IO_LINK : 0;
+    sqe->user_data    = user_data;
+}
+
+void IoUring::prep_cancel_fd(const int fd, const uint64_t user_data) {
+    io_uring_sqe* sqe  = get_sqe();
+    sqe->opcode        = IORING_OP_ASYNC_CANCEL;
+    sqe->fd            = fd;
+    sqe->cancel_flags  = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+    sqe->user_data     = user_data;
+}
+
+bool IoUring::submit(const unsigned wait_nr) {
+    if (_nqueued) {
+        store_release(_sq_tail, *_sq_tail + _nqueued);
+        _nqueued = 0;
+    }
+    // also whatever an interrupted submission left behind
+    const unsigned to_submit = *_sq_tail - load_acquire(_sq_head);
+    if (!to_submit && !wait_nr)
+        return true;
+    if (io_uring_enter(_fd, to_submit, wait_nr, wait_nr ? IORING_ENTER_GETEVENTS : 0) == -1) {
+        if (errno == EINTR)
+            return false;
+        fatal("io_uring_enter");
+    }
+    return true;
+}
+
+bool IoUring::reap(io_uring_cqe& cqe) {
+    unsigned head = *_cq_head;
+    if (head == load_acquire(_cq_tail))
+        return false;
+    cqe = _cqes[head & _cq_mask];
+    store_release(_cq_head, head + 1);
+    return true;
+}
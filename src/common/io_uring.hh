@@ -0,0 +1,142 @@
+#pragma once
+
+#include <linux/io_uring.h>
+#include <sys/socket.h>
+#include <cstddef>
+#include <cstdint>
+
+#include <memory>
+#include <string>
+
+/// How the hot I/O paths wait for and move datagrams.
+enum class IoBackend {
+    POLL,     ///< `poll()` plus a syscall per datagram (or per `sendmmsg()` batch).
+    IO_URING, ///< io_uring submissions and completions.
+};
+
+/**
+ * @brief Parses the name of an I/O backend.
+ * @param name "poll" or "io_uring".
+ * @param backend Filled with the backend.
+ * @return False if the name is unknown.
+ */
+bool parse_io_backend(const std::string& name, IoBackend& backend);
+
+/**
+ * @class IoUring
+ * @brief A minimal io_uring instance, driven by raw syscalls.
+ *
+ * Wraps the submission and completion rings along with an optional ring of provided buffers,
+ * which multishot receives pick their buffers from. Meant to be used by a single thread.
+ */
+class IoUring {
+public:
+    /**
+     * @brief Sets up an io_uring instance.
+     * @param entries Number of submission queue entries.
+     * @return The instance, or null if the kernel doesn't support io_uring (or doesn't allow it).
+     */
+    static std::unique_ptr<IoUring> create(unsigned entries);
+
+    ~IoUring();
+
+    IoUring(const IoUring&) = delete;
+    IoUring& operator=(const IoUring&) = delete;
+
+    /**
+     * @brief Registers a ring of provided buffers, for multishot receives.
+     * @param nbufs Number of buffers, a power of two.
+     * @param buf_size Size of each buffer.
+     * @return False if the kernel doesn't support provided buffer rings.
+     */
+    bool register_buffers(unsigned nbufs, size_t buf_size);
+
+    /**
+     * @brief Returns a provided buffer.
+     * @param bid Buffer id, as given in a completion.
+     * @return Pointer to the buffer.
+     */
+    char* buffer(uint16_t bid) const;
+
+    /**
+     * @brief Hands a provided buffer back to the kernel, once its contents have been handled.
+     * @param bid Buffer id, as given in a completion.
+     */
+    void recycle(uint16_t bid);
+
+    /**
+     * @brief Queues a multishot poll for readability, completing every time `fd` becomes readable.
+     * @param fd The file descriptor.
+     * @param user_data Tag of the completions.
+     */
+    void prep_poll_multishot(int fd, uint64_t user_data);
+
+    /**
+     * @brief Queues a multishot receive into provided buffers, completing once per datagram.
+     * @param fd The socket.
+     * @param user_data Tag of the completions.
+     */
+    void prep_recv_multishot(int fd, uint64_t user_data);
+
+    /**
+     * @brief Queues a `sendmsg()`.
+     * @param fd The socket.
+     * @param msg The message, which has to stay valid until the completion.
+     * @param user_data Tag of the completion.
+     * @param link Whether the next queued entry only starts after this one succeeds.
+     */
+    void prep_sendmsg(int fd, const msghdr* msg, uint64_t user_data, bool link);
+
+    /**
+     * @brief Queues cancelling all requests on a file descriptor.
+     * @param fd The file descriptor.
+     * @param user_data Tag of the completion.
+     */
+    void prep_cancel_fd(int fd, uint64_t user_data);
+
+    /**
+     * @brief Submits the queued entries and waits for completions.
+     * @param wait_nr Number of completions to wait for.
+     * @return True on success, false if interrupted by a signal.
+     * @throws Calls `fatal()` if `io_uring_enter()` fails otherwise.
+     */
+    bool submit(unsigned wait_nr = 0);
+
+    /**
+     * @brief Takes a completion off the completion ring, without waiting.
+     * @param cqe Filled with the completion.
+     * @return False if there's no completion.
+     */
+    bool reap(io_uring_cqe& cqe);
+
+private:
+    int _fd;
+    void* _sq_ring;
+    size_t _sq_ring_size;
+    void* _cq_ring;
+    size_t _cq_ring_size;
+    io_uring_sqe* _sqes;
+    size_t _sqes_size;
+
+    unsigned* _sq_head;
+    unsigned* _sq_tail;
+    unsigned* _sq_array;
+    unsigned _sq_mask;
+    unsigned _sq_entries;
+    unsigned _nqueued; ///< Entries queued since the last submission.
+
+    unsigned* _cq_head;
+    unsigned* _cq_tail;
+    io_uring_cqe* _cqes;
+    unsigned _cq_mask;
+
+    io_uring_buf_ring* _buf_ring; ///< Provided buffers, if registered.
+    char* _bufs;
+    unsigned _nbufs;
+    size_t _buf_size;
+
+    static constexpr uint16_t BUFFER_GROUP = 0;
+
+    IoUring();
+    io_uring_sqe* get_sqe();
+};
@@ -14,6 +14,8 @@
  */
 #define UDP_MAX_DATA_SIZE ((1 << 16) - 1) ///< Maximum UDP payload size (65535 bytes).
 
+#define IP_UDP_HDR_SIZE 28 ///< IPv4 (without options) and UDP headers, counted towards the MTU.
+
 /**
  * @def ADDR_MAX_LEN
  * @brief Maximum length of an IPv4 address as a string.
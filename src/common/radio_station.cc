@@ -39,7 +39,7 @@ bool RadioStation::cmp::operator()(const RadioStation& a, const RadioStation& b)
     return std::tie(a.name, a.mcast_addr, a.data_addr) < std::tie(b.name, b.mcast_addr, b.data_addr);
 }
 
-bool RadioStation::is_valid_name(const std::string& name) {
+bool RadioStation::is_valid_name(const std::string_view name) {
     if (name.empty() || name.front() == ' ' || name.back() == ' ' || name.size() > STATION_NAME_MAX_LEN)
         return false;
     return std::all_of(name.begin(), name.end(), [](unsigned char c) { return c >= 32 && c <= 127; });
@@ -5,6 +5,7 @@
 #include <netinet/in.h>
 
 #include <string>
+#include <string_view>
 #include <chrono>
 #include <set>
 
@@ -50,7 +51,7 @@ struct RadioStation {
      * @param name The station name to validate.
      * @return True if the name is valid, false otherwise.
      */
-    static bool is_valid_name(const std::string& name);
+    static bool is_valid_name(std::string_view name);
 
     /**
      * @struct cmp
@@ -3,6 +3,11 @@
 #include "log.hh"
 
 #include <unistd.h>
+#include <netinet/udp.h>
+#include <linux/net_tstamp.h>
+#include <cstring>
+
+#include <algorithm>
 
 UdpSocket::UdpSocket() : _mcast_recv_enabled(false) {
     if ((_fd = socket(AF_INET, SOCK_DGRAM, 0)) == -1)
@@ -45,6 +50,10 @@ void UdpSocket::set_opt(const int proto, const int type, void* val, const size_t
         fatal("setsockopt");
 }
 
+bool UdpSocket::try_set_opt(const int proto, const int type, void* val, const size_t val_size) {
+    return setsockopt(_fd, proto, type, val, val_size) == 0;
+}
+
 void UdpSocket::set_broadcast() {
     int val = 1;
     set_opt(SOL_SOCKET, SO_BROADCAST, &val, sizeof(val));
@@ -55,10 +64,53 @@ void UdpSocket::set_reuseaddr() {
     set_opt(SOL_SOCKET, SO_REUSEADDR, &val, sizeof(val));
 }
 
+void UdpSocket::set_reuseport() {
+    int val = 1;
+    set_opt(SOL_SOCKET, SO_REUSEPORT, &val, sizeof(val));
+}
+
+void UdpSocket::set_pktinfo() {
+    int val = 1;
+    set_opt(IPPROTO_IP, IP_PKTINFO, &val, sizeof(val));
+}
+
 void UdpSocket::set_mcast_ttl(int ttl) {
     set_opt(SOL_SOCKET, SO_REUSEADDR, &ttl, sizeof(ttl));
 }
 
+bool UdpSocket::try_set_segment_size(int segment_size) {
+    return try_set_opt(IPPROTO_UDP, UDP_SEGMENT, &segment_size, sizeof(segment_size));
+}
+
+bool UdpSocket::try_set_txtime(const clockid_t clock_id) {
+    sock_txtime txtime = {};
+    txtime.clockid = clock_id;
+    return try_set_opt(SOL_SOCKET, SO_TXTIME, &txtime, sizeof(txtime));
+}
+
+bool UdpSocket::try_set_busy_poll(int usecs) {
+    if (!try_set_opt(SOL_SOCKET, SO_BUSY_POLL, &usecs, sizeof(usecs)))
+        return false;
+#ifdef SO_PREFER_BUSY_POLL
+    int prefer = 1;
+    try_set_opt(SOL_SOCKET, SO_PREFER_BUSY_POLL, &prefer, sizeof(prefer)); // since Linux 5.11
+#endif
+    return true;
+}
+
+int UdpSocket::try_get_path_mtu(const sockaddr_in& dst_addr) {
+    int pmtudisc = IP_PMTUDISC_DO;
+    if (!try_set_opt(IPPROTO_IP, IP_MTU_DISCOVER, &pmtudisc, sizeof(pmtudisc)))
+        return -1;
+    if (::connect(_fd, (sockaddr*)&dst_addr, sizeof(dst_addr)) == -1)
+        return -1;
+    int mtu;
+    socklen_t mtu_len = sizeof(mtu);
+    if (getsockopt(_fd, IPPROTO_IP, IP_MTU, &mtu, &mtu_len) == -1)
+        return -1;
+    return mtu;
+}
+
 void UdpSocket::set_drop_membership() {
     set_opt(IPPROTO_IP, IP_DROP_SOURCE_MEMBERSHIP, &_ipmreq, sizeof(_ipmreq));
 }
@@ -102,15 +154,119 @@ void UdpSocket::bind(const in_port_t port) {
         fatal("bind");
 }
 
+in_port_t UdpSocket::local_port() const {
+    sockaddr_in addr;
+    socklen_t addr_len = sizeof(addr);
+    if (getsockname(_fd, (sockaddr*)&addr, &addr_len) == -1)
+        fatal("getsockname");
+    return ntohs(addr.sin_port);
+}
+
 ssize_t UdpSocket::sendto(const void* buf, const size_t nbytes, const sockaddr_in& dst_addr) const {
     return ::sendto(_fd, buf, nbytes, 0, (sockaddr*)&dst_addr, sizeof(dst_addr));
 }
 
+using TxtimeCmsg = char[CMSG_SPACE(sizeof(uint64_t))];
+
+static size_t fill_msgs(mmsghdr* msgs, TxtimeCmsg* ctrl_bufs, const iovec* bufs, const size_t nbufs,
+                        const sockaddr_in& dst_addr, const uint64_t* txtimes) {
+    size_t nmsgs = std::min(nbufs, UdpSocket::MAX_BATCH);
+    for (size_t i = 0; i < nmsgs; ++i) {
+        msgs[i].msg_hdr.msg_name    = (void*)&dst_addr;
+        msgs[i].msg_hdr.msg_namelen = sizeof(dst_addr);
+        msgs[i].msg_hdr.msg_iov     = (iovec*)&bufs[i];
+        msgs[i].msg_hdr.msg_iovlen  = 1;
+        if (txtimes) {
+            msgs[i].msg_hdr.msg_control    = ctrl_bufs[i];
+            msgs[i].msg_hdr.msg_controllen = sizeof(ctrl_bufs[i]);
+            cmsghdr* cmsg    = CMSG_FIRSTHDR(&msgs[i].msg_hdr);
+            cmsg->cmsg_level = SOL_SOCKET;
+            cmsg->cmsg_type  = SCM_TXTIME;
+            cmsg->cmsg_len   = CMSG_LEN(sizeof(uint64_t));
+            memcpy(CMSG_DATA(cmsg), &txtimes[i], sizeof(uint64_t));
+        }
+    }
+    return nmsgs;
+}
+
+ssize_t UdpSocket::sendmmsg(const iovec* bufs, const size_t nbufs, const sockaddr_in& dst_addr, const uint64_t* txtimes) const {
+    mmsghdr msgs[MAX_BATCH] = {};
+    TxtimeCmsg ctrl_bufs[MAX_BATCH] = {};
+    size_t nmsgs = fill_msgs(msgs, ctrl_bufs, bufs, nbufs, dst_addr, txtimes);
+    return ::sendmmsg(_fd, msgs, nmsgs, 0);
+}
+
+ssize_t UdpSocket::sendmmsg(IoUring& ring, const iovec* bufs, const size_t nbufs, const sockaddr_in& dst_addr,
+                            const uint64_t* txtimes) const {
+    mmsghdr msgs[MAX_BATCH] = {};
+    TxtimeCmsg ctrl_bufs[MAX_BATCH] = {};
+    size_t nmsgs = fill_msgs(msgs, ctrl_bufs, bufs, nbufs, dst_addr, txtimes);
+    for (size_t i = 0; i < nmsgs; ++i)
+        ring.prep_sendmsg(_fd, &msgs[i].msg_hdr, i, i + 1 < nmsgs);
+
+    // the messages live on this stack frame, so every completion has to be in before returning
+    size_t ncompleted = 0, nsent = nmsgs;
+    int error = 0;
+    while (ncompleted < nmsgs) {
+        ring.submit(nmsgs - ncompleted);
+        io_uring_cqe cqe;
+        while (ring.reap(cqe)) {
+            ncompleted++;
+            if (cqe.res < 0 && cqe.user_data < nsent) {
+                nsent = cqe.user_data; // the rest of the chain gets cancelled
+                error = -cqe.res;
+            }
+        }
+    }
+    if (nsent == 0) {
+        errno = error;
+        return -1;
+    }
+    return nsent;
+}
+
 ssize_t UdpSocket::recvfrom(void* buf, const size_t nbytes, sockaddr_in& src_addr) const {
     socklen_t addr_len = sizeof(src_addr);
     return ::recvfrom(_fd, buf, nbytes, 0, (sockaddr*)&src_addr, &addr_len);
 }
 
+ssize_t UdpSocket::recvfrom(void* buf, const size_t nbytes, sockaddr_in& src_addr, bool& unicast) const {
+    iovec iov = {buf, nbytes};
+    alignas(cmsghdr) char control[CMSG_SPACE(sizeof(in_pktinfo))];
+    msghdr msg         = {};
+    msg.msg_name       = &src_addr;
+    msg.msg_namelen    = sizeof(src_addr);
+    msg.msg_iov        = &iov;
+    msg.msg_iovlen     = 1;
+    msg.msg_control    = control;
+    msg.msg_controllen = sizeof(control);
+    ssize_t nread = ::recvmsg(_fd, &msg, 0);
+
+    unicast = true;
+    for (cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); nread != -1 && cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level != IPPROTO_IP || cmsg->cmsg_type != IP_PKTINFO)
+            continue;
+        // the kernel answers from the destination address itself only if it was a local unicast one
+        in_pktinfo info;
+        memcpy(&info, CMSG_DATA(cmsg), sizeof(info));
+        unicast = info.ipi_addr.s_addr == info.ipi_spec_dst.s_addr;
+    }
+    return nread;
+}
+
+ssize_t UdpSocket::recvmmsg(const iovec* bufs, const size_t nbufs, size_t* nbytes) const {
+    mmsghdr msgs[MAX_BATCH] = {};
+    size_t nmsgs = std::min(nbufs, MAX_BATCH);
+    for (size_t i = 0; i < nmsgs; ++i) {
+        msgs[i].msg_hdr.msg_iov    = (iovec*)&bufs[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+    int nrecv = ::recvmmsg(_fd, msgs, nmsgs, MSG_DONTWAIT, nullptr);
+    for (int i = 0; i < nrecv; ++i)
+        nbytes[i] = msgs[i].msg_len;
+    return nrecv;
+}
+
 size_t UdpSocket::read(void* buf, const size_t nbytes) const {
     return ::read(_fd, buf, nbytes);
 }
@@ -1,7 +1,9 @@
 #pragma once
 
 #include "net.hh"
+#include "io_uring.hh"
 #include <netinet/in.h>
+#include <sys/uio.h>
 
 /**
  * @class UdpSocket
@@ -28,6 +30,16 @@ private:
      */
     void set_opt(int proto, int type, void* val, size_t val_size);
 
+    /**
+     * @brief Sets a socket option, without terminating on failure.
+     * @param proto Protocol level (e.g., SOL_SOCKET, IPPROTO_UDP).
+     * @param type Option type.
+     * @param val Pointer to the option value.
+     * @param val_size Size of the option value.
+     * @return True if the option was set, false otherwise.
+     */
+    bool try_set_opt(int proto, int type, void* val, size_t val_size);
+
     /**
      * @brief Binds the socket to a specific local port.
      * @param port Port number to bind to.
@@ -35,6 +47,8 @@ private:
     void set_local_port(in_port_t port);
 
 public:
+    static constexpr size_t MAX_BATCH = 64; ///< Maximum number of datagrams sent or received in one batch.
+
     sockaddr_in local_addr; ///< Stores the local address of the socket.
     sockaddr_in conn_addr;  ///< Stores the address of the connected peer.
 
@@ -82,6 +96,16 @@ public:
      */
     void set_reuseaddr();
 
+    /**
+     * @brief Lets several sockets bind the same port, with the kernel spreading datagrams among them by flow.
+     */
+    void set_reuseport();
+
+    /**
+     * @brief Enables `IP_PKTINFO`, for `recvfrom()` to tell unicast datagrams from broadcast and multicast ones.
+     */
+    void set_pktinfo();
+
     /**
      * @brief Sets the multicast TTL (Time-To-Live).
      * @param ttl The TTL value (default: `DEFAULT_TTL`).
@@ -94,6 +118,43 @@ public:
      */
     void set_sending_timeout(int secs);
 
+    /**
+     * @brief Enables UDP generic segmentation offload (GSO) on the socket.
+     *
+     * Once enabled, every send larger than `segment_size` is split by the kernel
+     * (or the NIC) into datagrams of `segment_size` bytes each.
+     * @param segment_size Size of a single datagram.
+     * @return True if the kernel supports GSO, false otherwise.
+     */
+    bool try_set_segment_size(int segment_size);
+
+    /**
+     * @brief Enables `SO_TXTIME`, letting the kernel pace datagrams by their transmit times.
+     * @param clock_id The clock transmit times are given in.
+     * @return True if the kernel supports `SO_TXTIME`, false otherwise.
+     */
+    bool try_set_txtime(clockid_t clock_id);
+
+    /**
+     * @brief Enables `SO_BUSY_POLL`, and `SO_PREFER_BUSY_POLL` where available, on the socket.
+     *
+     * Blocking receives then poll the device queue for up to `usecs` microseconds instead of
+     * waiting for an interrupt. Raising it above `net.core.busy_poll` needs `CAP_NET_ADMIN`.
+     * @param usecs How long to busy poll for.
+     * @return True if `SO_BUSY_POLL` was set, false otherwise.
+     */
+    bool try_set_busy_poll(int usecs);
+
+    /**
+     * @brief Discovers the MTU of the path to a destination.
+     *
+     * Connects the socket to the destination and forbids fragmentation on it, so that the
+     * kernel reports the path MTU it knows of (the MTU of the outgoing interface, at first).
+     * @param dst_addr The destination.
+     * @return The path MTU, or -1 if it can't be determined.
+     */
+    int try_get_path_mtu(const sockaddr_in& dst_addr);
+
     /**
      * @brief Adds the socket to a multicast group.
      */
@@ -122,6 +183,12 @@ public:
      */
     void bind(in_port_t port = 0);
 
+    /**
+     * @brief Returns the port the socket is bound to, also when it was picked by the kernel.
+     * @return The local port, in host byte order.
+     */
+    in_port_t local_port() const;
+
     /**
      * @brief Connects the socket to a remote address.
      * @param conn_addr The address to connect to.
@@ -152,6 +219,30 @@ public:
      */
     ssize_t sendto(const void* buf, size_t nbytes, const sockaddr_in &dst_addr) const;
 
+    /**
+     * @brief Sends a batch of datagrams to a specific destination with a single `sendmmsg()` call.
+     * @param bufs Buffers holding the datagrams, one per datagram (at most `MAX_BATCH`).
+     * @param nbufs Number of datagrams in the batch.
+     * @param dst_addr Destination address.
+     * @param txtimes Transmit times of the datagrams in nanoseconds, if `SO_TXTIME` is enabled.
+     * @return Number of datagrams sent, or -1 on error.
+     */
+    ssize_t sendmmsg(const iovec* bufs, size_t nbufs, const sockaddr_in& dst_addr, const uint64_t* txtimes = nullptr) const;
+
+    /**
+     * @brief Sends a batch of datagrams to a specific destination with a single io_uring submission.
+     *
+     * The sends are linked, so they go out in order; waits until all of them complete.
+     * @param ring The io_uring instance to submit to, with no other requests in flight.
+     * @param bufs Buffers holding the datagrams, one per datagram (at most `MAX_BATCH`).
+     * @param nbufs Number of datagrams in the batch.
+     * @param dst_addr Destination address.
+     * @param txtimes Transmit times of the datagrams in nanoseconds, if `SO_TXTIME` is enabled.
+     * @return Number of datagrams sent, or -1 on error.
+     */
+    ssize_t sendmmsg(IoUring& ring, const iovec* bufs, size_t nbufs, const sockaddr_in& dst_addr,
+                     const uint64_t* txtimes = nullptr) const;
+
     /**
      * @brief Receives data and retrieves the sender's address.
      * @param buf Pointer to the buffer to store received data.
@@ -160,4 +251,25 @@ public:
      * @return Number of bytes received, or -1 on error.
      */
     ssize_t recvfrom(void* buf, size_t nbytes, sockaddr_in& src_addr) const;
+
+    /**
+     * @brief Receives data, retrieves the sender's address and whether the datagram was unicast.
+     *
+     * Needs `set_pktinfo()`, without which every datagram counts as unicast.
+     * @param buf Pointer to the buffer to store received data.
+     * @param nbytes Maximum number of bytes to receive.
+     * @param src_addr Structure to store sender's address.
+     * @param unicast Set to false if the datagram was sent to a broadcast or multicast address.
+     * @return Number of bytes received, or -1 on error.
+     */
+    ssize_t recvfrom(void* buf, size_t nbytes, sockaddr_in& src_addr, bool& unicast) const;
+
+    /**
+     * @brief Receives the datagrams already queued on the socket with a single `recvmmsg()` call, without blocking.
+     * @param bufs Buffers for the datagrams, one per datagram (at most `MAX_BATCH`).
+     * @param nbufs Number of buffers.
+     * @param nbytes Filled with the sizes of the received datagrams.
+     * @return Number of datagrams received, or -1 on error (`EAGAIN` if none was queued).
+     */
+    ssize_t recvmmsg(const iovec* bufs, size_t nbufs, size_t* nbytes) const;
 };
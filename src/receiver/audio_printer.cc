@@ -18,11 +18,16 @@ AudioPrinterWorker::AudioPrinterWorker(
 
 void AudioPrinterWorker::handle_print() {
     auto buf_lock = _buffer.lock();
+    // the receiver notifies once per batch of packets, so there may be several due - or none,
+    // if an earlier notification already took them
+    size_t npackets = _buffer->take_due();
+    if (npackets == 0)
+        return;
     // note: we don't notify AudioReceiver and he doesn't reset the session.
     // This allows for a much better user experience, less choppy sound, just occasional silence
-    if (!_buffer->occupied(_buffer->tail()))
+    if (_buffer->cnt_upto_gap() < npackets)
         log_warn("[%s] detected packet loss!", name.c_str());
-    _buffer->dump_tail(_buffer->psize());
+    _buffer->dump_tail(npackets * _buffer->psize());
 }
 
 void AudioPrinterWorker::run() {
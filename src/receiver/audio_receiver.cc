@@ -11,7 +11,16 @@
 
 #define MY_EVENT    0
 #define NETWORK     1
-#define NUM_POLLFDS 2
+#define PARITY      2
+#define NUM_POLLFDS 3
+
+#define CANCEL      NUM_POLLFDS ///< Tag of io_uring cancellations, past the ones of the pollfds.
+#define TAG_BITS    8           ///< Low bits of io_uring user data holding the tag, the rest is the generation.
+
+#define URING_ENTRIES 16
+#define URING_NBUFS   64 ///< Provided buffers for received datagrams, a power of two.
+
+#define RECV_BATCH    16 ///< Maximum number of datagrams received with a single `recvmmsg()`.
 
 AudioReceiverWorker::AudioReceiverWorker(
     const volatile sig_atomic_t& running,
@@ -19,7 +28,10 @@ AudioReceiverWorker::AudioReceiverWorker(
     const SyncedPtr<StationSet>& stations,
     const SyncedPtr<StationSet::iterator>& current_station,
     const SyncedPtr<EventQueue>& my_event,
-    const SyncedPtr<EventQueue>& audio_printer_event
+    const SyncedPtr<EventQueue>& audio_printer_event,
+    const bool fec,
+    const std::chrono::microseconds busy_poll,
+    const IoBackend io_backend
 )
     : Worker(running, "AudioReceiver")
     , _buffer(buffer)
@@ -27,14 +39,29 @@ AudioReceiverWorker::AudioReceiverWorker(
     , _current_station(current_station)
     , _my_event(my_event)
     , _audio_printer_event(audio_printer_event)
-    {}
+    , _fec(fec)
+    , _poller(busy_poll)
+    , _io_backend(io_backend)
+    , _batch(RECV_BATCH * UDP_MAX_DATA_SIZE)
+    , _batch_bufs(RECV_BATCH)
+    , _batch_lens(RECV_BATCH)
+    , _npackets(0)
+    , _nsyscalls(0)
+{
+    for (size_t i = 0; i < RECV_BATCH; ++i)
+        _batch_bufs[i] = {_batch.data() + i * UDP_MAX_DATA_SIZE, UDP_MAX_DATA_SIZE};
+}
 
-AudioPacket AudioReceiverWorker::read_packet() {
-    char pkt_buf[UDP_MAX_DATA_SIZE + 1] = {0};
-    ssize_t psize = _data_socket.read(pkt_buf, sizeof(pkt_buf) - 1) - 2 * sizeof(uint64_t);
+AudioPacket AudioReceiverWorker::parse_packet(const char* buf, const ssize_t nbytes) {
+    ssize_t psize = nbytes - 2 * sizeof(uint64_t);
     if (psize < 0)
         throw RadioException("Malformed packet");
-    return AudioPacket(pkt_buf, psize);
+    return AudioPacket(buf, psize);
+}
+
+void AudioReceiverWorker::set_busy_poll(UdpSocket& socket) {
+    if (_poller.enabled() && !socket.try_set_busy_poll(_poller.budget().count()))
+        log_warn("[%s] unable to set SO_BUSY_POLL (%s), spinning in userspace only", name.c_str(), strerror(errno));
 }
 
 void AudioReceiverWorker::change_station() {
@@ -45,56 +72,170 @@ void AudioReceiverWorker::change_station() {
         _data_socket = UdpSocket();
         _data_socket.enable_mcast_recv((*_current_station)->mcast_addr, (*_current_station)->data_addr);
         _data_socket.bind(ntohs((*_current_station)->data_addr.sin_port));
+        set_busy_poll(_data_socket);
+    }
+
+    if (!_fec)
+        return;
+    _parity_socket.~UdpSocket();
+    if (!_stations->empty()) {
+        in_port_t parity_port = ntohs((*_current_station)->data_addr.sin_port) + 1;
+        _parity_socket = UdpSocket();
+        _parity_socket.enable_mcast_recv((*_current_station)->mcast_addr, (*_current_station)->data_addr);
+        _parity_socket.bind(parity_port);
+        set_busy_poll(_parity_socket);
     }
 }
 
-void AudioReceiverWorker::handle_audio_packet(const AudioPacket& packet, bool& has_printed, uint64_t& cur_session) {
+// the buffer has to be locked
+bool AudioReceiverWorker::store_audio_packet(const AudioPacket& packet, bool& has_printed, uint64_t& cur_session) {
     if (packet.session_id < cur_session) {
         log_info("[%s] ignoring old session %llu...", name.c_str(), packet.session_id);
-        return;
+        return false;
     }
 
     if (_buffer->psize() > _buffer->capacity()) {
         log_info("[%s] packet size too large, ignoring session %llu...", name.c_str(), packet.session_id);
         cur_session = NO_SESSION;
-        return;
+        return false;
     }
 
     if (packet.session_id > cur_session) {
         log_info("[%s] new session %llu!", name.c_str(), packet.session_id);
         cur_session = packet.session_id;
         has_printed = false;
-        auto lock = _buffer.lock();
         _buffer->reset(packet.psize, packet.first_byte_num);
     }
 
     if (packet.first_byte_num < _buffer->byte0()) {
         log_info("[%s] packet %zu arrived too late, ignoring...", name.c_str(), packet.first_byte_num);
-        return;
+        return false;
     }
 
-    auto lock = _buffer.lock();
-    _buffer->try_put(std::move(packet));
+    if (!_buffer->try_put(std::move(packet))) {
+        // a burst loss longer than the reorder window - start over from this packet like from a
+        // new session, so that the buffer fills up to the printing threshold again
+        log_info("[%s] packet %zu is beyond the reorder window, resyncing...", name.c_str(), packet.first_byte_num);
+        has_printed = false;
+        _buffer->reset(packet.psize, packet.first_byte_num);
+        _buffer->try_put(packet);
+    }
     if (has_printed || packet.first_byte_num + _buffer->psize() - 1 >= _buffer->printing_threshold()) {
         has_printed |= true;
-        _audio_printer_event.lock();
-        _audio_printer_event->push(EventQueue::EventType::NEW_JOBS);
+        return true;
     }
+    return false;
 }
 
-void AudioReceiverWorker::run() {
+void AudioReceiverWorker::handle_audio_packet(const AudioPacket& packet, bool& has_printed, uint64_t& cur_session) {
+    {
+        auto lock = _buffer.lock();
+        if (!store_audio_packet(packet, has_printed, cur_session))
+            return;
+        _buffer->add_due(1);
+    }
+    _audio_printer_event.lock();
+    _audio_printer_event->push(EventQueue::EventType::NEW_JOBS);
+}
+
+void AudioReceiverWorker::handle_audio_batch(const size_t npackets, bool& has_printed, uint64_t& cur_session) {
+    size_t ndue = 0;
+    {
+        auto lock = _buffer.lock();
+        for (size_t i = 0; i < npackets; ++i) {
+            try {
+                ndue += store_audio_packet(parse_packet((const char*)_batch_bufs[i].iov_base, _batch_lens[i]),
+                                           has_printed, cur_session);
+            } catch (std::exception& e) {
+                log_error("[%s] failed to read packet: %s", name.c_str(), e.what());
+            }
+        }
+        if (ndue == 0)
+            return;
+        _buffer->add_due(ndue);
+    }
+    // the printer is woken up once per batch, and prints all packets due
+    _audio_printer_event.lock();
+    _audio_printer_event->push(EventQueue::EventType::NEW_JOBS);
+}
+
+size_t AudioReceiverWorker::receive_audio(bool& has_printed, uint64_t& cur_session) {
+    // drains the socket, a batch per syscall, until a batch comes out short
+    size_t nreceived = 0;
+    ssize_t nrecv;
+    do {
+        nrecv = _data_socket.recvmmsg(_batch_bufs.data(), RECV_BATCH, _batch_lens.data());
+        if (nrecv == -1) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                log_error("[%s] failed to receive packets: %s", name.c_str(), strerror(errno));
+            break;
+        }
+        _nsyscalls++;
+        _npackets += nrecv;
+        nreceived += nrecv;
+        handle_audio_batch(nrecv, has_printed, cur_session);
+    } while (nrecv == RECV_BATCH);
+    return nreceived;
+}
+
+void AudioReceiverWorker::handle_parity_packet(const char* pkt_buf, const ssize_t nbytes, bool& has_printed, uint64_t& cur_session) {
+    ParityHeader header;
+    if (nbytes == -1 || !ParityHeader::parse(pkt_buf, nbytes, header)) {
+        log_error("[%s] malformed parity packet", name.c_str());
+        return;
+    }
+    if (header.session_id != cur_session)
+        return;
+
+    uint64_t missing = UINT64_MAX;
+    {
+        auto lock = _buffer.lock();
+        const size_t psize = _buffer->psize();
+        if ((size_t)nbytes - ParityHeader::SIZE != psize)
+            return;
+
+        // the parity is the XOR of the packets it covers, so XORing it with all but one of them yields the last one
+        _recovered.assign(pkt_buf + ParityHeader::SIZE, pkt_buf + nbytes);
+        uint64_t byte_num;
+        for (size_t i = 0; (byte_num = header.covered(i, psize)) != UINT64_MAX; ++i) {
+            if (byte_num < _buffer->abs_tail())
+                return; // already played, or not received in time anyway
+            const char* audio = _buffer->packet_at(byte_num);
+            if (audio)
+                xor_bytes(_recovered.data(), audio, psize);
+            else if (missing == UINT64_MAX)
+                missing = byte_num;
+            else
+                return; // more than one lost, left for retransmission
+        }
+    }
+    if (missing == UINT64_MAX)
+        return; // nothing lost
+
+    log_info("[%s] recovered packet %llu from parity", name.c_str(), missing);
+    handle_audio_packet(AudioPacket(cur_session, missing, _recovered.data(), _recovered.size()), has_printed, cur_session);
+}
+
+void AudioReceiverWorker::run_poll() {
     bool has_printed = false;
     uint64_t cur_session = NO_SESSION;
+    char pkt_buf[UDP_MAX_DATA_SIZE];
     pollfd poll_fds[NUM_POLLFDS];
     poll_fds[MY_EVENT].fd = _my_event->in_fd();
     poll_fds[NETWORK].fd  = _data_socket.fd();
+    poll_fds[PARITY].fd   = _fec ? _parity_socket.fd() : -1;
     for (size_t i = 0; i < NUM_POLLFDS; ++i) {
         poll_fds[i].events  = POLLIN;
         poll_fds[i].revents = 0;
     }
 
     while (running) {
-        if (poll(poll_fds, NUM_POLLFDS, -1)) == -1)
+        // spins on the receives themselves - a poll() that doesn't block would never busy poll
+        // the device queue, a non-blocking recvmmsg() on a socket with SO_BUSY_POLL does
+        bool caught = _data_socket.fd() != -1
+                   && _poller.spin([&] { return receive_audio(has_printed, cur_session) > 0; });
+        // after a catch, only looks at the other descriptors before spinning again
+        if ((caught ? poll(poll_fds, NUM_POLLFDS, 0) : _poller.block(poll_fds, NUM_POLLFDS, -1)) == -1)
             fatal("poll");
 
         if (poll_fds[MY_EVENT].revents & POLLIN) {
@@ -107,6 +248,7 @@ void AudioReceiverWorker::run() {
                     log_info("[%s] changing station", name.c_str());
                     change_station();
                     poll_fds[NETWORK].fd = _data_socket.fd();
+                    poll_fds[PARITY].fd  = _fec ? _parity_socket.fd() : -1;
                     cur_session = NO_SESSION;
                 default: break;
             }
@@ -114,13 +256,127 @@ void AudioReceiverWorker::run() {
 
         if (poll_fds[NETWORK].revents & POLLIN) {
             poll_fds[NETWORK].revents = 0;
-            try {
-                AudioPacket packet = read_packet();
-                handle_audio_packet(std::move(packet), has_printed, cur_session);
-            } catch (std::exception& e) {
-                log_error("[%s] failed to read packet: %s", name.c_str(), e.what());
+            receive_audio(has_printed, cur_session);
+        }
+
+        if (poll_fds[PARITY].revents & POLLIN) {
+            poll_fds[PARITY].revents = 0;
+            handle_parity_packet(pkt_buf, _parity_socket.read(pkt_buf, sizeof(pkt_buf)), has_printed, cur_session);
+        }
+    }
+}
+
+void AudioReceiverWorker::arm_receives(IoUring& ring, const uint64_t generation) {
+    if (_data_socket.fd() != -1)
+        ring.prep_recv_multishot(_data_socket.fd(), NETWORK | generation << TAG_BITS);
+    if (_fec && _parity_socket.fd() != -1)
+        ring.prep_recv_multishot(_parity_socket.fd(), PARITY | generation << TAG_BITS);
+}
+
+void AudioReceiverWorker::cancel_receives(IoUring& ring) {
+    // the ring holds on to the sockets until their receives are gone, so wait for that
+    // before closing them - their ports are about to be bound again
+    size_t ncancels = 0;
+    for (int fd : {_data_socket.fd(), _fec ? _parity_socket.fd() : -1})
+        if (fd != -1) {
+            ring.prep_cancel_fd(fd, CANCEL);
+            ncancels++;
+        }
+    while (ncancels) {
+        ring.submit(1);
+        io_uring_cqe cqe;
+        while (ring.reap(cqe)) {
+            const uint64_t tag = cqe.user_data & ((1 << TAG_BITS) - 1);
+            if (tag == CANCEL)
+                ncancels--;
+            else if (cqe.flags & IORING_CQE_F_BUFFER)
+                ring.recycle(cqe.flags >> IORING_CQE_BUFFER_SHIFT); // from the old station, dropped
+            else if (tag == MY_EVENT && !(cqe.flags & IORING_CQE_F_MORE))
+                ring.prep_poll_multishot(_my_event->in_fd(), MY_EVENT);
+        }
+    }
+}
+
+bool AudioReceiverWorker::run_uring() {
+    auto ring = IoUring::create(URING_ENTRIES);
+    if (!ring || !ring->register_buffers(URING_NBUFS, UDP_MAX_DATA_SIZE)) {
+        log_warn("[%s] io_uring is not available, falling back to poll", name.c_str());
+        return false;
+    }
+    if (_poller.enabled())
+        log_warn("[%s] io_uring waits for completions without spinning, BUSY_POLL is ignored", name.c_str());
+
+    bool has_printed = false;
+    uint64_t cur_session = NO_SESSION;
+    uint64_t generation  = 0; ///< Bumped with every station change, to tell stale completions apart.
+    ring->prep_poll_multishot(_my_event->in_fd(), MY_EVENT);
+    arm_receives(*ring, generation);
+
+    while (running) {
+        if (!ring->submit(1))
+            continue;
+
+        io_uring_cqe cqe;
+        while (ring->reap(cqe)) {
+            const uint64_t tag  = cqe.user_data & ((1 << TAG_BITS) - 1);
+            const bool current  = cqe.user_data >> TAG_BITS == generation;
+            const bool more     = cqe.flags & IORING_CQE_F_MORE;
+
+            if (tag == MY_EVENT) {
+                if (!more)
+                    ring->prep_poll_multishot(_my_event->in_fd(), MY_EVENT);
+                // one wakeup may stand for several events
+                EventQueue::EventType event_val;
+                while ((event_val = _my_event->pop()) != EventQueue::EventType::NONE) {
+                    switch (event_val) {
+                        case EventQueue::EventType::TERMINATE:
+                            return true;
+                        case EventQueue::EventType::CURRENT_STATION_CHANGED:
+                            log_info("[%s] changing station", name.c_str());
+                            cancel_receives(*ring);
+                            change_station();
+                            arm_receives(*ring, ++generation);
+                            cur_session = NO_SESSION;
+                        default: break;
+                    }
+                }
+                continue;
+            }
+            if (tag != NETWORK && tag != PARITY)
+                continue;
+
+            if (cqe.flags & IORING_CQE_F_BUFFER) {
+                uint16_t bid = cqe.flags >> IORING_CQE_BUFFER_SHIFT;
+                if (current && tag == NETWORK) {
+                    try {
+                        handle_audio_packet(parse_packet(ring->buffer(bid), cqe.res), has_printed, cur_session);
+                    } catch (std::exception& e) {
+                        log_error("[%s] failed to read packet: %s", name.c_str(), e.what());
+                    }
+                } else if (current)
+                    handle_parity_packet(ring->buffer(bid), cqe.res, has_printed, cur_session);
+                ring->recycle(bid);
+            } else if (cqe.res < 0 && cqe.res != -ECANCELED && cqe.res != -ENOBUFS)
+                log_error("[%s] failed to receive: %s", name.c_str(), strerror(-cqe.res));
+
+            // a multishot receive stops e.g. when it runs out of buffers
+            if (!more && current) {
+                if (tag == NETWORK && _data_socket.fd() != -1)
+                    ring->prep_recv_multishot(_data_socket.fd(), cqe.user_data);
+                else if (tag == PARITY && _parity_socket.fd() != -1)
+                    ring->prep_recv_multishot(_parity_socket.fd(), cqe.user_data);
             }
         }
     }
+    return true;
+}
+
+void AudioReceiverWorker::run() {
+    if (_io_backend != IoBackend::IO_URING || !run_uring())
+        run_poll();
+    if (_nsyscalls)
+        log_info("[%s] received %zu packets in %zu syscalls (%.2f packets/syscall)", name.c_str(),
+                 _npackets, _nsyscalls, (double)_npackets / _nsyscalls);
+    _poller.report(name);
     log_debug("[%s] going down", name.c_str());
 }
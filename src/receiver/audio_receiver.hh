@@ -7,10 +7,16 @@
 #include "../common/circular_buffer.hh"
 #include "../common/radio_station.hh"
 #include "../common/synced_ptr.hh"
+#include "../common/fec.hh"
+#include "../common/busy_poll.hh"
+#include "../common/io_uring.hh"
 
 #include "poll.h"
 #include <cstddef>
 
+#include <chrono>
+#include <vector>
+
 struct AudioReceiverWorker : public Worker {
 private:
     UdpSocket _data_socket;
@@ -19,10 +25,30 @@ private:
     SyncedPtr<StationSet::iterator> _current_station;
     SyncedPtr<EventQueue> _my_event;
     SyncedPtr<EventQueue> _audio_printer_event;
+    bool _fec;                    ///< Whether to recover lost packets from parity packets.
+    UdpSocket _parity_socket;     ///< Receives parity packets, on DATA_PORT + 1.
+    std::vector<char> _recovered; ///< A packet being recovered.
+    BusyPoller _poller;           ///< Spins for packets before blocking, if enabled.
+    IoBackend _io_backend;
+
+    std::vector<char> _batch;         ///< Buffers of a batch of received datagrams, back to back.
+    std::vector<iovec> _batch_bufs;   ///< The buffers in `_batch`.
+    std::vector<size_t> _batch_lens;  ///< Sizes of the datagrams received into `_batch_bufs`.
+    size_t _npackets;                 ///< Number of audio packets received so far.
+    size_t _nsyscalls;                ///< Number of syscalls they were received in.
 
-    AudioPacket read_packet();
+    AudioPacket parse_packet(const char* buf, ssize_t nbytes);
     void change_station();
+    bool store_audio_packet(const AudioPacket& packet, bool& has_printed, uint64_t& cur_session);
     void handle_audio_packet(const AudioPacket& packet, bool& has_printed, uint64_t& cur_session);
+    void handle_audio_batch(size_t npackets, bool& has_printed, uint64_t& cur_session);
+    size_t receive_audio(bool& has_printed, uint64_t& cur_session);
+    void handle_parity_packet(const char* pkt_buf, ssize_t nbytes, bool& has_printed, uint64_t& cur_session);
+    void set_busy_poll(UdpSocket& socket);
+    void arm_receives(IoUring& ring, uint64_t generation);
+    void cancel_receives(IoUring& ring);
+    void run_poll();
+    bool run_uring();
 public:
     AudioReceiverWorker() = delete;
     AudioReceiverWorker(
@@ -31,7 +57,10 @@ public:
         const SyncedPtr<StationSet>& stations,
         const SyncedPtr<StationSet::iterator>& current_station,
         const SyncedPtr<EventQueue>& my_event,
-        const SyncedPtr<EventQueue>& audio_printer_event
+        const SyncedPtr<EventQueue>& audio_printer_event,
+        const bool fec,
+        const std::chrono::microseconds busy_poll,
+        const IoBackend io_backend
     );
 
     void run() override;
@@ -27,7 +27,7 @@ static void terminate_worker(const int worker_id) {
     if (!signalled[worker_id]) { // ńecessary check for the handler to be reentrant
         event_queues[worker_id].lock();
         signalled[worker_id] = true;
-        event_queues[worker_id]->push(EventQueue::EventType::TERMINATE);
+        event_queues[worker_id]->terminate();
     }
 }
 
@@ -58,7 +58,7 @@ int main(int argc, char* argv[]) {
     sockaddr_in discover_addr = get_addr(params.discover_addr.c_str(), params.ctrl_port);
     auto stations             = SyncedPtr<StationSet>::make();
     auto current_station      = SyncedPtr<StationSet::iterator>::make(stations->end());
-    auto buffer               = SyncedPtr<CircularBuffer>::make(params.bsize);
+    auto buffer               = SyncedPtr<CircularBuffer>::make(params.bsize, params.reorder_window);
     auto ctrl_socket          = std::make_shared<UdpSocket>();
     ctrl_socket->set_broadcast();
 
@@ -73,7 +73,8 @@ int main(int argc, char* argv[]) {
     );
     workers[AUDIO_RECEIVER] = std::make_shared<AudioReceiverWorker>(
         running, buffer, stations, current_station,
-        event_queues[AUDIO_RECEIVER], event_queues[AUDIO_PRINTER]
+        event_queues[AUDIO_RECEIVER], event_queues[AUDIO_PRINTER],
+        params.fec, params.busy_poll, params.io_backend
     );
     workers[LOOKUP_RECEIVER] = std::make_shared<LookupReceiverWorker>(
         running, stations, current_station, event_queues[LOOKUP_RECEIVER],
@@ -4,6 +4,7 @@
 #include "../common/except.hh"
 #include "../common/datagram.hh"
 #include "../common/radio_station.hh"
+#include "../common/io_uring.hh"
 
 #include <netinet/in.h>
 #include <cstddef>
@@ -22,7 +23,11 @@ struct ReceiverParams {
     in_port_t ctrl_port, ui_port;
     std::string discover_addr;
     size_t bsize;
+    size_t reorder_window;
     std::chrono::milliseconds rtime;
+    bool fec;
+    std::chrono::microseconds busy_poll;
+    IoBackend io_backend;
 
     ReceiverParams() = default;
 
@@ -35,7 +40,11 @@ struct ReceiverParams {
             ("ctrl_port,C",     bpo::value<in_port_t>()->default_value(39629), "CTRL_PORT")
             ("ui_port,U",       bpo::value<in_port_t>()->default_value(19629), "UI_PORT")
             ("bsize,b",         bpo::value<size_t>()->default_value(65536), "BSIZE")
-            ("rtime,R",         bpo::value<size_t>()->default_value(250), "RTIME");
+            ("reorder_window,W", bpo::value<size_t>()->default_value(64), "how many packets ahead of the next expected one are still stored, the buffer restarts from ones further ahead")
+            ("rtime,R",         bpo::value<size_t>()->default_value(250), "RTIME")
+            ("fec,F",           bpo::bool_switch()->default_value(false), "recover lost packets from parity packets on DATA_PORT + 1")
+            ("busy_poll,u",     bpo::value<size_t>()->default_value(0), "microseconds to spin on non-blocking receives of audio packets, busy polling the device (SO_BUSY_POLL), before blocking (0 - never); poll backend only")
+            ("io_backend,I",    bpo::value<std::string>()->default_value("poll"), "how audio packets are received: poll or io_uring");
 
         bpo::variables_map vm;
         bpo::store(bpo::parse_command_line(argc, argv, desc), vm);
@@ -57,9 +66,16 @@ struct ReceiverParams {
         ctrl_port             = vm["ctrl_port"].as<in_port_t>();
         ui_port               = vm["ui_port"].as<in_port_t>();
         bsize                 = vm["bsize"].as<size_t>();
+        reorder_window        = vm["reorder_window"].as<size_t>();
         rtime                 = std::chrono::milliseconds(vm["rtime"].as<size_t>());
+        fec                   = vm["fec"].as<bool>();
+        busy_poll             = std::chrono::microseconds(vm["busy_poll"].as<size_t>());
+        if (!parse_io_backend(vm["io_backend"].as<std::string>(), io_backend))
+            throw RadioException("IO_BACKEND must be poll or io_uring");
 
         if (bsize < 1)
             throw RadioException("BSIZE must be positive");
+        if (reorder_window < 1)
+            throw RadioException("REORDER_WINDOW must be positive");
     }
 };
@@ -25,11 +25,8 @@ RexmitSenderWorker::RexmitSenderWorker(
     _ctrl_socket.set_sending_timeout(SENDING_TIMEOUT.count());
 }
 
-// notes:
-// - this turns out to be a more efficient approach
-//   than the one described in the task description
-// - here we assume that the request will fit
-//   in a UDP packet
+// note: this turns out to be a more efficient approach
+// than the one described in the task description
 void RexmitSenderWorker::order_retransmission() {
     auto stations_lock        = _stations.lock();
     auto current_station_lock = _current_station.lock();
@@ -37,34 +34,20 @@ void RexmitSenderWorker::order_retransmission() {
         return; // not connected to any station => no one to ask for retransmission
 
     auto buffer_lock = _buffer.lock();
-    size_t i = _buffer->tail();
     std::vector<uint64_t> packet_ids;
-
-    if (!_buffer->empty()) {
-        while (i != _buffer->head()) {
-            if (!_buffer->occupied(i))
-                packet_ids.push_back(i + _buffer->abs_tail());
-            i = (i + _buffer->psize()) % _buffer->rounded_cap();
-        }
-    }
+    _buffer->missing_ids(packet_ids);
 
     if (packet_ids.size() > 0) {
-        try {
-            sockaddr_in my_addr = {};
-            my_addr.sin_family      = AF_INET;
-            my_addr.sin_addr.s_addr = INADDR_ANY;
-            my_addr.sin_port        = 0;
-
-            RexmitRequest request(my_addr, packet_ids);
-            std::string request_str = request.to_str();
-            log_info("[%s] sending rexmit request: %s", name.c_str(), request_str.c_str());
-            // not checking the return value here, as if something went wront, the station will be switched soon
-            // (aside from the assumption that the packet fits)
-            if (request_str.length() == _ctrl_socket.sendto(request_str.c_str(), request_str.length(), (*_current_station)->ctrl_addr))
-                log_error("[%s] sending rexmit request failed");
-        } catch (const std::exception& e) {
-            fatal("[%s] malformed rexmit request: %s", name.c_str());
+        char request_buf[UDP_MAX_DATA_SIZE];
+        size_t request_len = RexmitRequest::write(packet_ids, request_buf, sizeof(request_buf));
+        if (request_len == 0) {
+            log_error("[%s] rexmit request doesn't fit in a datagram", name.c_str());
+            return;
         }
+        log_info("[%s] sending rexmit request: %.*s", name.c_str(), (int)request_len, request_buf);
+        // not checking the return value here, as if something went wront, the station will be switched soon
+        if ((ssize_t)request_len != _ctrl_socket.sendto(request_buf, request_len, (*_current_station)->ctrl_addr))
+            log_error("[%s] sending rexmit request failed", name.c_str());
     }
 }
 
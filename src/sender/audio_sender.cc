@@ -1,14 +1,30 @@
 #include "audio_sender.hh"
 
+#include "../common/endian.hh"
+
 #include <unistd.h>
+#include <fcntl.h>
 #include <poll.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/timerfd.h>
+#include <climits>
+#include <ctime>
 
 #include <thread>
 #include <chrono>
+#include <algorithm>
 
+#define TIMER       0
 #define MY_EVENT    1
 #define NUM_POLLFDS 2
 
+#define NSECS_PER_SEC 1000000000ull
+
+#define GSO_MAX_SEGMENTS 64 ///< Maximum number of segments in a GSO super-datagram (UDP_MAX_SEGMENTS on older kernels).
+
+#define DEFAULT_INGEST_SIZE (1 << 16) ///< Bytes read from stdin at once, unless it's a pipe of a different capacity.
+
 // Credits: Hubert Lubański
 // static bool simulate_interference() {
 //     static const int max_lost_per_burst = 8;
@@ -33,33 +49,336 @@
 AudioSenderWorker::AudioSenderWorker(
     const volatile sig_atomic_t& running,
     const sockaddr_in& mcast_addr,
-    const SyncedPtr<CircularBuffer>& packet_cache,
+    const std::shared_ptr<PacketCache>& packet_cache,
     const SyncedPtr<EventQueue>& my_event,
     const size_t psize,
-    const uint64_t session_id
+    const size_t batch,
+    const bool gso,
+    const std::string& input,
+    const size_t rate,
+    const bool txtime,
+    const size_t fec_ndata,
+    const size_t fec_nparity,
+    const std::chrono::microseconds busy_poll,
+    const IoBackend io_backend,
+    const std::string& station_name
 )
-    : Worker(running, "AudioSender")
+    : Worker(running, "AudioSender " + station_name)
     , _packet_cache(packet_cache)
     , _my_event(my_event)
     , _psize(psize)
-    , _session_id(session_id)
     , _mcast_addr(mcast_addr)
+    , _batch(batch)
+    , _partial(nullptr)
+    , _nread(0)
+    , _first_byte_num(0)
+    , _ingest_slots(input.empty() ? ingest_slots(psize) : 0)
+    , _ingest_bufs(input.empty() ? ingest_slots(psize) : 0)
+    , _input(input)
+    , _rate(rate)
+    , _txtime(false)
+    , _fec_ndata(fec_ndata)
+    , _fec_nparity(fec_nparity)
+    , _parity_addr(mcast_addr)
+    , _parity(fec_ndata ? fec_nparity * (ParityHeader::SIZE + psize) : 0)
+    , _poller(busy_poll)
+    , _npackets(0)
+    , _nsyscalls(0)
+    , _nparity(0)
 {
     _data_socket.set_mcast_ttl();
+    _parity_socket.set_mcast_ttl();
+    _parity_addr.sin_port = htons(ntohs(mcast_addr.sin_port) + 1);
+
+    _tx_mode = _batch > 1 ? TxMode::SENDMMSG : TxMode::SENDTO;
+    if (txtime && !_input.empty()) {
+        // every packet carries its own transmit time, which a GSO super-datagram can't do
+        if (_data_socket.try_set_txtime(CLOCK_MONOTONIC) && (!_fec_ndata || _parity_socket.try_set_txtime(CLOCK_MONOTONIC))) {
+            _txtime  = true;
+            _tx_mode = TxMode::SENDMMSG;
+        } else
+            log_warn("[%s] SO_TXTIME is not supported, pacing with a timer only", name.c_str());
+    }
+    if (gso && _batch > 1 && !_txtime) {
+        size_t max_segments = std::min((size_t)GSO_MAX_SEGMENTS, (UDP_MAX_DATA_SIZE - IP_UDP_HDR_SIZE) / TOTAL_PSIZE(_psize));
+        if (max_segments < 2)
+            log_warn("[%s] packets are too large for GSO, using sendmmsg", name.c_str());
+        else if (!_data_socket.try_set_segment_size(TOTAL_PSIZE(_psize)))
+            log_warn("[%s] UDP GSO is not supported, using sendmmsg", name.c_str());
+        else {
+            _tx_mode = TxMode::GSO;
+            _batch   = std::min(_batch, max_segments);
+        }
+    }
+    if (io_backend == IoBackend::IO_URING && _tx_mode != TxMode::GSO) {
+        // a whole batch is linked in one submission, so the ring has to fit it
+        if ((_ring = IoUring::create(UdpSocket::MAX_BATCH)))
+            _tx_mode = TxMode::IO_URING;
+        else
+            log_warn("[%s] io_uring is not available, using %s", name.c_str(), _batch > 1 ? "sendmmsg" : "sendto");
+    }
+    _pending.reserve(_batch);
+    _txtimes.reserve(_batch);
 }
 
-void AudioSenderWorker::send_packet(AudioPacket&& packet) {
-    if (TOTAL_PSIZE(packet.psize) != _data_socket.sendto(packet.bytes.get(), TOTAL_PSIZE(packet.psize), _mcast_addr))
-        fatal("[%s] unable to send audio packet", name.c_str());
-    auto lock = _packet_cache.lock();
-    _packet_cache->try_put(packet);
+void AudioSenderWorker::fall_back(const TxMode tx_mode) {
+    if (_tx_mode == TxMode::GSO)
+        _data_socket.try_set_segment_size(0);
+    _ring.reset();
+    log_warn("[%s] batched send failed (%s), falling back to %s",
+        name.c_str(), strerror(errno), tx_mode == TxMode::SENDMMSG ? "sendmmsg" : "sendto");
+    _tx_mode = tx_mode;
 }
 
-void AudioSenderWorker::run() {
-    char audio_buf[_psize + 1];
-    size_t nread = 0;
-    memset(audio_buf, 0, sizeof(audio_buf));
+size_t AudioSenderWorker::send_some(const size_t from) {
+    const size_t pkt_size = TOTAL_PSIZE(_psize);
+    const size_t count    = _pending.size() - from;
+    switch (_tx_mode) {
+        case TxMode::GSO: {
+            // a super-datagram has to be contiguous, so it ends where the cache wraps around
+            size_t ncontiguous = 1;
+            while (ncontiguous < count && _pending[from + ncontiguous] == _pending[from] + ncontiguous * pkt_size)
+                ncontiguous++;
+            ssize_t res = _data_socket.sendto(_pending[from], ncontiguous * pkt_size, _mcast_addr);
+            if (res == -1 && (errno == EIO || errno == EINVAL || errno == EOPNOTSUPP)) {
+                fall_back(TxMode::SENDMMSG); // e.g. the egress device can't offload checksums
+                return 0;
+            }
+            if (res != (ssize_t)(ncontiguous * pkt_size))
+                fatal("[%s] unable to send audio packets", name.c_str());
+            _nsyscalls++;
+            return ncontiguous;
+        }
+        case TxMode::SENDMMSG: {
+            iovec bufs[UdpSocket::MAX_BATCH];
+            for (size_t i = 0; i < count; ++i)
+                bufs[i] = {_pending[from + i], pkt_size};
+            ssize_t res = _data_socket.sendmmsg(bufs, count, _mcast_addr, _txtime ? &_txtimes[from] : nullptr);
+            if (res == -1 && errno == ENOSYS) {
+                fall_back(TxMode::SENDTO);
+                return 0;
+            }
+            if (res <= 0)
+                fatal("[%s] unable to send audio packets", name.c_str());
+            _nsyscalls++;
+            return res;
+        }
+        case TxMode::IO_URING: {
+            iovec bufs[UdpSocket::MAX_BATCH];
+            for (size_t i = 0; i < count; ++i)
+                bufs[i] = {_pending[from + i], pkt_size};
+            ssize_t res = _data_socket.sendmmsg(*_ring, bufs, count, _mcast_addr, _txtime ? &_txtimes[from] : nullptr);
+            if (res == -1 && (errno == EINVAL || errno == EOPNOTSUPP)) {
+                fall_back(TxMode::SENDMMSG); // e.g. sendmsg isn't supported by this kernel's io_uring
+                return 0;
+            }
+            if (res <= 0)
+                fatal("[%s] unable to send audio packets", name.c_str());
+            _nsyscalls++;
+            return res;
+        }
+        default:
+            if ((ssize_t)pkt_size != _data_socket.sendto(_pending[from], pkt_size, _mcast_addr))
+                fatal("[%s] unable to send audio packet", name.c_str());
+            _nsyscalls++;
+            return 1;
+    }
+}
+
+void AudioSenderWorker::flush_packets() {
+    size_t nsent = 0;
+    while (nsent < _pending.size())
+        nsent += send_some(nsent);
+    _npackets += nsent;
+
+    _packet_cache->commit(_pending.size());
+    _pending.clear();
+    _txtimes.clear();
+}
 
+bool AudioSenderWorker::add_to_parity(const char* packet) {
+    uint64_t val;
+    memcpy(&val, packet + sizeof(val), sizeof(val));
+    uint64_t packet_no   = ntohll(val) / _psize;
+    size_t idx           = packet_no % _fec_ndata;
+    const size_t pkt_size = ParityHeader::SIZE + _psize;
+
+    if (idx == 0) { // a new group
+        memcpy(&val, packet, sizeof(val));
+        ParityHeader header = {ntohll(val), packet_no * _psize, (uint16_t)_fec_ndata, (uint16_t)_fec_nparity, 0};
+        std::fill(_parity.begin(), _parity.end(), 0);
+        for (size_t j = 0; j < _fec_nparity; ++j) {
+            header.index = j;
+            header.write(_parity.data() + j * pkt_size);
+        }
+    }
+    xor_bytes(_parity.data() + idx % _fec_nparity * pkt_size + ParityHeader::SIZE,
+              packet + PacketCache::HEADER_SIZE, _psize);
+    return idx == _fec_ndata - 1;
+}
+
+void AudioSenderWorker::send_parity(const uint64_t txtime) {
+    const size_t pkt_size = ParityHeader::SIZE + _psize;
+    iovec bufs[UdpSocket::MAX_BATCH];
+    uint64_t txtimes[UdpSocket::MAX_BATCH];
+    for (size_t i = 0; i < _fec_nparity; ++i) {
+        bufs[i]    = {_parity.data() + i * pkt_size, pkt_size};
+        txtimes[i] = txtime;
+    }
+    if ((ssize_t)_fec_nparity != _parity_socket.sendmmsg(bufs, _fec_nparity, _parity_addr, _txtime ? txtimes : nullptr))
+        fatal("[%s] unable to send parity packets", name.c_str());
+    _nparity += _fec_nparity;
+}
+
+void AudioSenderWorker::enqueue_packet(char* packet) {
+    _pending.push_back(packet);
+    if (!_fec_ndata || !add_to_parity(packet)) {
+        if (_pending.size() == _batch)
+            flush_packets();
+        return;
+    }
+
+    // the group is complete, its parity goes right behind it
+    uint64_t txtime = _txtime ? _txtimes.back() : 0;
+    flush_packets();
+    send_parity(txtime);
+}
+
+size_t AudioSenderWorker::ingest_slots(const size_t psize) {
+    // a pipe holds at most that much, so there's no point in reading more at once
+    int pipe_size = fcntl(STDIN_FILENO, F_GETPIPE_SZ);
+    size_t ingest_size = pipe_size > 0 ? pipe_size : DEFAULT_INGEST_SIZE;
+    return std::clamp(ingest_size / psize, (size_t)1, (size_t)IOV_MAX);
+}
+
+bool AudioSenderWorker::ingest() {
+    // read a whole block at once, scattered straight into consecutive cache slots
+    if (!_partial)
+        _partial = _packet_cache->stage(_first_byte_num);
+    _ingest_slots[0] = _partial;
+    _ingest_bufs[0]  = {_partial + PacketCache::HEADER_SIZE + _nread, _psize - _nread};
+    for (size_t i = 1; i < _ingest_slots.size(); ++i) {
+        _ingest_slots[i] = _packet_cache->stage(_first_byte_num + i * _psize);
+        _ingest_bufs[i]  = {_ingest_slots[i] + PacketCache::HEADER_SIZE, _psize};
+    }
+
+    ssize_t res = readv(STDIN_FILENO, _ingest_bufs.data(), _ingest_bufs.size());
+    if (res == -1)
+        fatal("read");
+    if (res == 0) {
+        _packet_cache->unstage(_ingest_slots.size() - 1);
+        return false; // end of input or incomplete packet
+    }
+
+    size_t nbytes    = _nread + res;
+    size_t ncomplete = nbytes / _psize;
+    for (size_t i = 0; i < ncomplete; ++i) {
+        log_info("[%s] sending packet #%llu", name.c_str(), _first_byte_num);
+        enqueue_packet(_ingest_slots[i]);
+        _first_byte_num += _psize;
+    }
+    _nread   = nbytes % _psize;
+    _partial = _nread ? _ingest_slots[ncomplete] : nullptr;
+    _packet_cache->unstage(_ingest_slots.size() - ncomplete - (_nread ? 1 : 0));
+    return true;
+}
+
+void AudioSenderWorker::report_stats() const {
+    log_info("[%s] sent %zu packets in %zu syscalls (%.2f packets/syscall) and %zu parity packets", name.c_str(),
+        _npackets, _nsyscalls, _nsyscalls ? (double)_npackets / _nsyscalls : 0.0, _nparity);
+}
+
+uint64_t AudioSenderWorker::deadline(const uint64_t start, const uint64_t byte_num) const {
+    // split, so that it doesn't overflow even for files of many gigabytes
+    return start + byte_num / _rate * NSECS_PER_SEC + byte_num % _rate * NSECS_PER_SEC / _rate;
+}
+
+static uint64_t now_ns() {
+    timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * NSECS_PER_SEC + now.tv_nsec;
+}
+
+void AudioSenderWorker::run_file() {
+    int fd = open(_input.c_str(), O_RDONLY);
+    if (fd == -1)
+        fatal("[%s] unable to open %s", name.c_str(), _input.c_str());
+    struct stat st;
+    if (fstat(fd, &st) == -1)
+        fatal("fstat");
+    const size_t size = st.st_size;
+    const uint64_t npackets = size / _psize; // an incomplete trailing packet is dropped, like with stdin
+    if (npackets == 0) {
+        close(fd);
+        return;
+    }
+    const char* audio = (const char*)mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (audio == MAP_FAILED)
+        fatal("mmap");
+    madvise((void*)audio, size, MADV_SEQUENTIAL);
+    close(fd);
+
+    int timer_fd = timerfd_create(CLOCK_MONOTONIC, 0);
+    if (timer_fd == -1)
+        fatal("timerfd_create");
+
+    pollfd poll_fds[NUM_POLLFDS];
+    poll_fds[TIMER].fd    = timer_fd;
+    poll_fds[MY_EVENT].fd = _my_event->in_fd();
+    for (size_t i = 0; i < NUM_POLLFDS; ++i) {
+        poll_fds[i].events  = POLLIN;
+        poll_fds[i].revents = 0;
+    }
+
+    // with SO_TXTIME a batch is handed over ahead of time and the kernel holds every packet until it's due
+    const uint64_t lead  = _txtime ? deadline(0, _batch * _psize) : 0;
+    const uint64_t start = now_ns() + lead;
+    uint64_t packet_no   = 0;
+    while (running && packet_no < npackets) {
+        uint64_t wakeup  = deadline(start, packet_no * _psize) - lead;
+        itimerspec timer = {};
+        timer.it_value.tv_sec  = wakeup / NSECS_PER_SEC;
+        timer.it_value.tv_nsec = wakeup % NSECS_PER_SEC;
+        if (timerfd_settime(timer_fd, TFD_TIMER_ABSTIME, &timer, nullptr) == -1)
+            fatal("timerfd_settime");
+
+        if (_poller.poll(poll_fds, NUM_POLLFDS, -1) == -1)
+            fatal("poll");
+
+        if (poll_fds[MY_EVENT].revents & POLLIN) {
+            poll_fds[MY_EVENT].revents = 0;
+            EventQueue::EventType event_val = _my_event->pop();
+            if (event_val == EventQueue::EventType::TERMINATE)
+                break;
+        }
+
+        if (poll_fds[TIMER].revents & POLLIN) {
+            poll_fds[TIMER].revents = 0;
+            uint64_t expirations;
+            if (read(timer_fd, &expirations, sizeof expirations) == -1)
+                fatal("read");
+
+            // send everything that's due by now - after a late wakeup, that's more than one packet;
+            // with SO_TXTIME, also everything due before the next wakeup, so that whole batches go at once
+            const uint64_t horizon = now_ns() + 2 * lead;
+            do {
+                uint64_t first_byte_num = packet_no * _psize;
+                char* packet = _packet_cache->stage(first_byte_num);
+                memcpy(packet + PacketCache::HEADER_SIZE, audio + first_byte_num, _psize);
+                log_info("[%s] sending packet #%llu", name.c_str(), first_byte_num);
+                if (_txtime)
+                    _txtimes.push_back(deadline(start, first_byte_num));
+                enqueue_packet(packet);
+            } while (++packet_no < npackets && deadline(start, packet_no * _psize) <= horizon);
+            flush_packets();
+        }
+    }
+
+    close(timer_fd);
+    munmap((void*)audio, size);
+}
+
+void AudioSenderWorker::run_stdin() {
     pollfd poll_fds[NUM_POLLFDS];
     poll_fds[STDIN_FILENO].fd   = STDIN_FILENO;
     poll_fds[MY_EVENT].fd = _my_event->in_fd();
@@ -68,10 +387,15 @@ void AudioSenderWorker::run() {
         poll_fds[i].revents = 0;
     }
 
-    size_t first_byte_num = 0;
     while (running) {
-        if (poll(poll_fds, NUM_POLLFDS, -1)) == -1)
+        // with packets pending, don't wait for more input - send what's ready once stdin runs dry
+        int nready = _poller.poll(poll_fds, NUM_POLLFDS, _pending.empty() ? -1 : 0);
+        if (nready == -1)
             fatal("poll");
+        if (nready == 0) {
+            flush_packets();
+            continue;
+        }
 
         if (poll_fds[MY_EVENT].revents & POLLIN) {
             poll_fds[MY_EVENT].revents = 0;
@@ -85,19 +409,18 @@ void AudioSenderWorker::run() {
 
         if (poll_fds[STDIN_FILENO].revents & POLLIN) {
             poll_fds[STDIN_FILENO].revents = 0;
-            ssize_t res = read(STDIN_FILENO, audio_buf + nread, _psize - nread);
-            if (res == -1)
-                fatal("read");
-            if (res == 0)
-                break; // end of input or incomplete packet
-            nread += res;
-            if (nread == _psize) {
-                log_info("[%s] sending packet #%llu", name.c_str(), first_byte_num);
-                send_packet(AudioPacket(_session_id, first_byte_num, audio_buf, _psize));
-                first_byte_num += _psize;
-                memset(audio_buf, 0, sizeof(audio_buf));
-                nread = 0;
-            }
+            if (!ingest())
+                break;
         }
     }
 }
+
+void AudioSenderWorker::run() {
+    if (_input.empty())
+        run_stdin();
+    else
+        run_file();
+    flush_packets();
+    report_stats();
+    _poller.report(name);
+}
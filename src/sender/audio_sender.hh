@@ -5,30 +5,98 @@
 #include "../common/datagram.hh"
 #include "../common/udp_socket.hh"
 #include "../common/synced_ptr.hh"
-#include "../common/circular_buffer.hh"
+#include "packet_cache.hh"
+#include "../common/fec.hh"
+#include "../common/busy_poll.hh"
 
 #include <netinet/in.h>
 
+#include <vector>
+#include <memory>
+#include <string>
+#include <chrono>
+
 struct AudioSenderWorker : public Worker {
 private:
+    /// How ready packets are handed over to the kernel.
+    enum class TxMode {
+        SENDTO,   ///< One `sendto()` per packet.
+        SENDMMSG, ///< One `sendmmsg()` per batch.
+        GSO,      ///< One UDP GSO super-datagram per batch.
+        IO_URING, ///< One io_uring submission of linked `sendmsg()`s per batch.
+    };
+
     UdpSocket _data_socket;
-    SyncedPtr<CircularBuffer> _packet_cache;
+    std::shared_ptr<PacketCache> _packet_cache;
     SyncedPtr<EventQueue> _my_event;
     size_t _psize;
-    uint64_t _session_id;
     sockaddr_in _mcast_addr;
 
-    void send_packet(AudioPacket&& packet);
+    TxMode _tx_mode;
+    std::unique_ptr<IoUring> _ring; ///< Submits the sends in the `IO_URING` mode.
+    size_t _batch;               ///< Maximum number of packets per syscall.
+    std::vector<char*> _pending; ///< Staged packets waiting to be sent, in the packet cache.
+
+    char* _partial;                   ///< The staged packet being read into, if any.
+    size_t _nread;                    ///< Number of audio bytes already read into `_partial`.
+    uint64_t _first_byte_num;         ///< The byte offset of the packet being read.
+    std::vector<char*> _ingest_slots; ///< Slots a single read is scattered into.
+    std::vector<iovec> _ingest_bufs;  ///< Audio data areas of `_ingest_slots`.
+
+    std::string _input;             ///< Raw audio file sent instead of stdin, if any.
+    size_t _rate;                   ///< Pace of sending `_input`, in bytes per second.
+    bool _txtime;                   ///< Whether the kernel releases packets at their `SO_TXTIME` transmit times.
+    std::vector<uint64_t> _txtimes; ///< Transmit times of `_pending`.
+
+    size_t _fec_ndata;          ///< Number of data packets per FEC group (0 - no FEC).
+    size_t _fec_nparity;        ///< Number of parity packets per FEC group.
+    UdpSocket _parity_socket;   ///< Separate, so that parity packets are never GSO-segmented.
+    sockaddr_in _parity_addr;   ///< DATA_PORT + 1 of the multicast address.
+    std::vector<char> _parity;  ///< Parity packets of the current group, back to back.
+
+    BusyPoller _poller; ///< Spins for input or the next deadline before blocking, if enabled.
+
+    size_t _npackets;  ///< Number of packets sent so far.
+    size_t _nsyscalls; ///< Number of send syscalls issued so far.
+    size_t _nparity;   ///< Number of parity packets sent so far.
+
+    void fall_back(TxMode tx_mode);
+    size_t send_some(size_t from);
+    void flush_packets();
+    bool add_to_parity(const char* packet);
+    void send_parity(uint64_t txtime);
+    void enqueue_packet(char* packet);
+    bool ingest();
+    uint64_t deadline(uint64_t start, uint64_t byte_num) const;
+    void run_stdin();
+    void run_file();
+    void report_stats() const;
 public:
     AudioSenderWorker() = delete;
     AudioSenderWorker(
         const volatile sig_atomic_t& running,
         const sockaddr_in& mcast_addr,
-        const SyncedPtr<CircularBuffer>& packet_cache,
+        const std::shared_ptr<PacketCache>& packet_cache,
         const SyncedPtr<EventQueue>& my_event,
         const size_t psize,
-        const uint64_t session_id
+        const size_t batch,
+        const bool gso,
+        const std::string& input,
+        const size_t rate,
+        const bool txtime,
+        const size_t fec_ndata,
+        const size_t fec_nparity,
+        const std::chrono::microseconds busy_poll,
+        const IoBackend io_backend,
+        const std::string& station_name
     );
 
+    /**
+     * @brief Computes how many packets a single read from stdin may fill.
+     * @param psize Size of an individual audio packet.
+     * @return The number of staging slots needed for reading, on top of a batch of packets.
+     */
+    static size_t ingest_slots(size_t psize);
+
     void run() override;
 };
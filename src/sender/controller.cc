@@ -5,54 +5,116 @@
 
 #include <poll.h>
 
-#define MY_EVENT    0
-#define NETWORK     1
-#define NUM_POLLFDS 2
+#include <vector>
+
+#define MY_EVENT 0
+#define NETWORK  1 ///< The first of the stations' sockets.
+
+static const char* const reject_reason_names[] = {
+    "unknown prefix",
+    "malformed lookup request",
+    "malformed rexmit request",
+};
 
 ControllerWorker::ControllerWorker(
     const volatile sig_atomic_t& running,
     const SyncedPtr<EventQueue>& my_event,
     const SyncedPtr<EventQueue>& retransmitter_event,
-    const SyncedPtr<std::queue<RexmitRequest>>& rexmit_job_queue,
-    const std::string& mcast_addr,
-    const in_port_t data_port,
-    const std::string& name,
-    const in_port_t ctrl_port
+    const std::shared_ptr<RexmitJobQueue>& rexmit_job_queue,
+    const std::vector<StationParams>& stations,
+    const std::vector<in_port_t>& ctrl_ports,
+    const size_t shard,
+    const bool reuseport
 )
-    : Worker(running, "Controller")
+    : Worker(running, reuseport ? "Controller " + std::to_string(shard) : "Controller")
     , _my_event(my_event)
     , _retransmitter_event(retransmitter_event)
     ,  _rexmit_job_queue(rexmit_job_queue)
-    , _lookup_reply(mcast_addr, data_port, name)
+    , _answers_group_lookups(shard == 0)
 {
-    _ctrl_socket.bind(ctrl_port);
+    _rejected.fill(0);
+    for (size_t i = 0; i < stations.size(); ++i) {
+        _lookup_replies.push_back(LookupReply(stations[i].mcast_addr, stations[i].data_port, stations[i].name).to_str());
+        UdpSocket& socket = _ctrl_sockets.emplace_back();
+        if (reuseport) {
+            socket.set_reuseport();
+            socket.set_pktinfo();
+        }
+        socket.bind(ctrl_ports[i]);
+    }
+}
+
+std::vector<in_port_t> ControllerWorker::ctrl_ports() const {
+    std::vector<in_port_t> ports;
+    for (const auto& socket : _ctrl_sockets)
+        ports.push_back(socket.local_port());
+    return ports;
 }
 
 void ControllerWorker::handle_lookup_request(const sockaddr_in& src_addr, [[maybe_unused]] LookupRequest&& req) {
-    auto reply = _lookup_reply.to_str();
-    if (reply.size() != _ctrl_socket.sendto(reply.c_str(), reply.size(), src_addr))
-        log_fatal("[%s] unable to send lookup reply", name.c_str());
+    // every hosted station replies
+    for (size_t i = 0; i < _lookup_replies.size(); ++i) {
+        const std::string& reply = _lookup_replies[i];
+        if ((ssize_t)reply.size() != _ctrl_sockets[i].sendto(reply.c_str(), reply.size(), src_addr))
+            log_fatal("[%s] unable to send lookup reply", name.c_str());
+    }
+}
+
+void ControllerWorker::handle_rexmit_request(const size_t station, const sockaddr_in& src_addr) {
+    switch (_rexmit_job_queue->push(station, src_addr, _packet_ids)) {
+        case RexmitJobQueue::PushResult::QUEUED_WAKEUP:
+            // no lock - the event queue takes many producers, like the job queue
+            _retransmitter_event->push(EventQueue::EventType::NEW_JOBS);
+            break;
+        case RexmitJobQueue::PushResult::DROPPED:
+            log_warn("[%s] rexmit job queue is full, dropped a request (%zu so far)",
+                     name.c_str(), _rexmit_job_queue->ndropped());
+            break;
+        default: break;
+    }
 }
 
-void ControllerWorker::handle_rexmit_request(const sockaddr_in& src_addr, RexmitRequest&& req) {
-    auto jobs_lock = _rexmit_job_queue.lock();
-    _rexmit_job_queue->push(std::move(req));
-    auto event_lock = _retransmitter_event.lock();
-    _retransmitter_event->push(EventQueue::EventType::NEW_JOBS);
+void ControllerWorker::reject(const RejectReason reason) {
+    log_error("[%s] rejected request: %s (%zu so far)", name.c_str(), reject_reason_names[reason], ++_rejected[reason]);
+}
+
+void ControllerWorker::handle_request(const size_t station, const sockaddr_in& src_addr, const bool unicast,
+                                      const char* buf, const size_t nbytes) {
+    std::string_view str(buf, nbytes);
+    switch (classify_request(str)) {
+        case DatagramType::LookupRequest:
+            if (!unicast && !_answers_group_lookups)
+                return; // another controller answers it
+            if (!LookupRequest::is_valid(str))
+                return reject(MALFORMED_LOOKUP);
+            log_info("[%s] got lookup request", name.c_str());
+            handle_lookup_request(src_addr, LookupRequest());
+            break;
+        case DatagramType::RexmitRequest:
+            _packet_ids.clear();
+            if (RexmitRequest::parse(str, _packet_ids))
+                return reject(MALFORMED_REXMIT);
+            log_info("[%s] got rexmit request", name.c_str());
+            handle_rexmit_request(station, src_addr);
+            break;
+        default:
+            reject(UNKNOWN_PREFIX);
+    }
 }
 
 void ControllerWorker::run() {
     char req_buf[UDP_MAX_DATA_SIZE + 1] = {0};
-    pollfd poll_fds[NUM_POLLFDS];
-    poll_fds[MY_EVENT].fd      = _my_event->in_fd();
-    poll_fds[NETWORK].fd       = _ctrl_socket.fd();
-    for (size_t i = 0; i < NUM_POLLFDS; ++i) {
-        poll_fds[i].revents = 0;
-        poll_fds[i].events  = POLLIN;
+    std::vector<pollfd> poll_fds(NETWORK + _ctrl_sockets.size());
+    poll_fds[MY_EVENT].fd = _my_event->in_fd();
+    for (size_t i = 0; i < _ctrl_sockets.size(); ++i)
+        poll_fds[NETWORK + i].fd = _ctrl_sockets[i].fd();
+    for (auto& poll_fd : poll_fds) {
+        poll_fd.revents = 0;
+        poll_fd.events  = POLLIN;
     }
 
     while (running) {
-        if (poll(poll_fds, NUM_POLLFDS, -1)) == -1)
+        if (poll(poll_fds.data(), poll_fds.size(), -1)) == -1)
             fatal("poll");
 
         if (poll_fds[MY_EVENT].revents & POLLIN) {
@@ -65,32 +127,19 @@ void ControllerWorker::run() {
             }
         }
 
-        if (poll_fds[NETWORK].revents & POLLIN) {
-            poll_fds[NETWORK].revents = 0;
-            sockaddr_in src_addr;
-            DatagramType req_type = DatagramType::None;
-            req_buf[_ctrl_socket.recvfrom(req_buf, sizeof(req_buf) - 1, src_addr)] = '\0';
-
-            try {
-                LookupRequest req(req_buf);
-                req_type = DatagramType::LookupRequest;
-                log_info("[%s] got lookup request", name.c_str());
-                handle_lookup_request(src_addr, std::move(req));
-            } catch (...) {}
-            if (req_type == DatagramType::LookupRequest)
+        for (size_t i = 0; i < _ctrl_sockets.size(); ++i) {
+            if (!(poll_fds[NETWORK + i].revents & POLLIN))
                 continue;
-
-            try {
-                RexmitRequest req(src_addr, req_buf);
-                req_type = DatagramType::RexmitRequest;
-                log_info("[%s] got rexmit request", name.c_str());
-                handle_rexmit_request(src_addr, std::move(req));
-            } catch (...) {}
-            if (req_type == DatagramType::RexmitRequest)
+            poll_fds[NETWORK + i].revents = 0;
+            sockaddr_in src_addr;
+            bool unicast;
+            ssize_t nread = _ctrl_sockets[i].recvfrom(req_buf, sizeof(req_buf) - 1, src_addr, unicast);
+            if (nread == -1) {
+                log_error("[%s] failed to receive request", name.c_str());
                 continue;
-
-            if (req_type == DatagramType::None)
-                log_error("[%s] unrecognized request", name.c_str());
+            }
+            req_buf[nread] = '\0';
+            handle_request(i, src_addr, unicast, req_buf, nread);
         }
     }
 }
@@ -1,6 +1,7 @@
 #pragma once
 
 #include "retransmitter.hh"
+#include "sender_params.hh"
 
 #include "../common/event_queue.hh"
 #include "../common/synced_ptr.hh"
@@ -11,30 +12,54 @@
 
 #include <memory>
 #include <string>
-#include <queue>
+#include <array>
+#include <deque>
+#include <vector>
 
 struct ControllerWorker : public Worker {
 private:
+    /// Why a control datagram was rejected.
+    enum RejectReason {
+        UNKNOWN_PREFIX,   ///< Neither a lookup nor a rexmit request.
+        MALFORMED_LOOKUP, ///< Lookup request prefix followed by garbage.
+        MALFORMED_REXMIT, ///< Rexmit request with invalid packet ids.
+        NUM_REJECT_REASONS,
+    };
+
+    std::array<size_t, NUM_REJECT_REASONS> _rejected; ///< Number of rejected datagrams, by reason.
     SyncedPtr<EventQueue> _my_event;
     SyncedPtr<EventQueue> _retransmitter_event;
-    SyncedPtr<std::queue<RexmitRequest>> _rexmit_job_queue;
-    UdpSocket _ctrl_socket;
-    LookupReply _lookup_reply;
+    std::shared_ptr<RexmitJobQueue> _rexmit_job_queue;
+    /// One socket per station: the first one listens on CTRL_PORT, the others on ephemeral ports.
+    /// Every station sends its lookup replies from its own socket, so that receivers send their
+    /// rexmit requests there, which tells the stations apart. With several controllers, each has
+    /// its own sockets on the same ports, and the kernel hashes receivers among them.
+    std::deque<UdpSocket> _ctrl_sockets;
+    /// Whether to answer lookups sent to a broadcast or multicast address. Those reach every
+    /// controller sharing the port, so only the first one does; unicast ones reach just one.
+    bool _answers_group_lookups;
+    std::vector<std::string> _lookup_replies; ///< Lookup replies of the stations, serialized once.
+    std::vector<uint64_t> _packet_ids;        ///< Reused for parsing rexmit requests.
 
     void handle_lookup_request(const sockaddr_in& src_addr, [[maybe_unused]] LookupRequest&& req);
-    void handle_rexmit_request(const sockaddr_in& src_addr, RexmitRequest&& req);
+    void handle_rexmit_request(size_t station, const sockaddr_in& src_addr);
+    void handle_request(size_t station, const sockaddr_in& src_addr, bool unicast, const char* buf, size_t nbytes);
+    void reject(RejectReason reason);
 public:
     ControllerWorker() = delete;
     ControllerWorker(
         const volatile sig_atomic_t& running,
         const SyncedPtr<EventQueue>& my_event,
         const SyncedPtr<EventQueue>& retransmitter_event,
-        const SyncedPtr<std::queue<RexmitRequest>>& rexmit_job_queue,
-        const std::string& mcast_addr,
-        const in_port_t data_port,
-        const std::string& name,
-        const in_port_t ctrl_port
+        const std::shared_ptr<RexmitJobQueue>& rexmit_job_queue,
+        const std::vector<StationParams>& stations,
+        const std::vector<in_port_t>& ctrl_ports,
+        const size_t shard,
+        const bool reuseport
     );
 
+    /// @return The ports the stations' sockets are bound to, for the other controllers to share.
+    std::vector<in_port_t> ctrl_ports() const;
+
     void run() override;
 };
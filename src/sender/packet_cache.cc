@@ -0,0 +1,106 @@
+#include "packet_cache.hh"
+
+#include "../common/endian.hh"
+#include "../common/log.hh"
+
+#include <cstring>
+#include <cassert>
+
+PacketCache::PacketCache(const uint64_t session_id, const size_t psize, const size_t fsize, const size_t nstaging)
+    : _session_id(session_id)
+    , _psize(psize)
+    , _nretained(fsize / psize)
+    , _nslots(fsize / psize + nstaging)
+    , _nstaged(0)
+    , _abs_head(0)
+{
+    try {
+        _seqs = new std::atomic<uint64_t>[_nslots]();
+        _data = new char[_nslots * packet_size()]();
+    } catch (const std::exception& e) {
+        fatal(e.what());
+    }
+}
+
+PacketCache::~PacketCache() {
+    delete[] _seqs;
+    delete[] _data;
+}
+
+size_t PacketCache::slot_of(const uint64_t first_byte_num) const {
+    return first_byte_num / _psize % _nslots;
+}
+
+char* PacketCache::slot(const size_t idx) const {
+    return _data + idx * packet_size();
+}
+
+char* PacketCache::stage(const uint64_t first_byte_num) {
+    assert(first_byte_num == _abs_head.load(std::memory_order_relaxed) + _nstaged * _psize);
+    assert(_nstaged < _nslots - _nretained);
+    size_t idx = slot_of(first_byte_num);
+
+    // the slot may still hold an evicted packet a reader is copying - make it odd, so the reader backs off
+    uint64_t seq = _seqs[idx].load(std::memory_order_relaxed);
+    if (seq % 2 == 0) {
+        _seqs[idx].store(seq + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+    }
+
+    char* packet = slot(idx);
+    uint64_t val = htonll(_session_id);
+    memcpy(packet, &val, sizeof(val));
+    val = htonll(first_byte_num);
+    memcpy(packet + sizeof(val), &val, sizeof(val));
+    _nstaged++;
+    return packet;
+}
+
+void PacketCache::unstage(const size_t npackets) {
+    assert(npackets <= _nstaged);
+    _nstaged -= npackets; // the released slots stay odd until they're committed
+}
+
+void PacketCache::commit(const size_t npackets) {
+    assert(npackets <= _nstaged);
+    uint64_t abs_head = _abs_head.load(std::memory_order_relaxed);
+    for (size_t i = 0; i < npackets; ++i) {
+        size_t idx = slot_of(abs_head + i * _psize);
+        _seqs[idx].store(_seqs[idx].load(std::memory_order_relaxed) + 1, std::memory_order_release);
+    }
+    _nstaged -= npackets;
+    _abs_head.store(abs_head + npackets * _psize, std::memory_order_release);
+}
+
+bool PacketCache::copy(const uint64_t first_byte_num, char* dst) const {
+    uint64_t abs_head = _abs_head.load(std::memory_order_acquire);
+    if (first_byte_num % _psize != 0 || first_byte_num >= abs_head
+        || abs_head - first_byte_num > _nretained * _psize)
+        return false;
+
+    size_t idx = slot_of(first_byte_num);
+    uint64_t seq = _seqs[idx].load(std::memory_order_acquire);
+    if (seq == 0 || seq % 2 == 1)
+        return false; // being reused by the writer
+    memcpy(dst, slot(idx), packet_size());
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (_seqs[idx].load(std::memory_order_relaxed) != seq)
+        return false; // overwritten while copying
+
+    // the slot might've been reused for a newer packet before the sequence number was read
+    uint64_t val;
+    memcpy(&val, dst + sizeof(val), sizeof(val));
+    return ntohll(val) == first_byte_num;
+}
+
+size_t PacketCache::psize() const {
+    return _psize;
+}
+
+size_t PacketCache::packet_size() const {
+    return TOTAL_PSIZE(_psize);
+}
+
+uint64_t PacketCache::abs_head() const {
+    return _abs_head.load(std::memory_order_acquire);
+}
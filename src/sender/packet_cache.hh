@@ -0,0 +1,91 @@
+#pragma once
+
+#include "../common/datagram.hh"
+
+#include <cstddef>
+#include <cstdint>
+#include <atomic>
+
+/**
+ * @class PacketCache
+ * @brief The sender's store of recently sent audio packets.
+ *
+ * Every slot holds a complete audio datagram - the session_id/first_byte_num
+ * header followed by PSIZE bytes of audio - so audio data can be read straight
+ * into a slot and sent from there without any copying.
+ *
+ * The cache keeps the last `FSIZE / PSIZE` committed packets. On top of that it
+ * has a few staging slots, which the (single) writer fills and sends before
+ * committing them. A packet always lands in slot `first_byte_num / PSIZE % nslots`.
+ *
+ * The cache has no lock. Every slot has a sequence number, which is odd while the
+ * writer reuses the slot and even once the packet in it is committed. Readers copy
+ * a packet out optimistically and keep the copy only if the sequence number didn't
+ * change meanwhile, so they never hold the writer up.
+ */
+class PacketCache {
+public:
+    /// Size of the header preceding the audio data in every slot.
+    inline static constexpr size_t HEADER_SIZE = 2 * sizeof(uint64_t);
+
+    /**
+     * @brief Constructs an empty cache.
+     * @param session_id The session identifier, written into every packet's header.
+     * @param psize Size of an individual audio packet's payload.
+     * @param fsize Number of audio bytes to keep for retransmission.
+     * @param nstaging Maximum number of packets staged at once.
+     */
+    PacketCache(uint64_t session_id, size_t psize, size_t fsize, size_t nstaging);
+
+    ~PacketCache();
+
+    /**
+     * @brief Reserves the next staging slot and fills in its header. Writer only.
+     * @param first_byte_num The byte offset of the packet's first audio byte.
+     * @return Pointer to the start of the packet; its audio data goes at `HEADER_SIZE`.
+     */
+    char* stage(uint64_t first_byte_num);
+
+    /**
+     * @brief Releases the newest staged slots, which turned out not to be needed. Writer only.
+     * @param npackets Number of slots to release.
+     */
+    void unstage(size_t npackets);
+
+    /**
+     * @brief Makes the oldest staged packets available for retransmission. Writer only.
+     * @param npackets Number of packets to commit.
+     */
+    void commit(size_t npackets);
+
+    /**
+     * @brief Copies a cached packet out, without ever blocking the writer.
+     * @param first_byte_num The byte offset of the packet's first audio byte.
+     * @param dst Buffer of at least `packet_size()` bytes.
+     * @return True if the packet was copied intact; false if it isn't cached
+     *         (evicted, not committed yet or not a packet boundary).
+     */
+    bool copy(uint64_t first_byte_num, char* dst) const;
+
+    /// @return The size of an individual packet's payload.
+    size_t psize() const;
+
+    /// @return The size of a complete packet, header included.
+    size_t packet_size() const;
+
+    /// @return The byte offset following the newest committed packet.
+    uint64_t abs_head() const;
+
+private:
+    uint64_t _session_id;            ///< Session identifier of the cached packets.
+    size_t _psize;                   ///< Size of an audio packet's payload.
+    size_t _nretained;               ///< Maximum number of committed packets.
+    size_t _nslots;                  ///< Total number of slots, staging ones included.
+    size_t _nstaged;                 ///< Number of staged packets.
+    std::atomic<uint64_t> _abs_head; ///< Byte offset following the newest committed packet.
+    std::atomic<uint64_t>* _seqs;    ///< Sequence numbers of the slots, 0 if never committed.
+    char* _data;                     ///< The slots, laid out back to back.
+
+    size_t slot_of(uint64_t first_byte_num) const;
+    char* slot(size_t idx) const;
+};
@@ -0,0 +1,55 @@
+#include "rate_limiter.hh"
+
+#include "../common/net.hh"
+
+#include <algorithm>
+#include <limits>
+
+RateLimiter::RateLimiter(const size_t byte_rate, const size_t packet_rate, const size_t max_receivers)
+    : _byte_rate(byte_rate)
+    , _packet_rate(packet_rate)
+    , _max_receivers(max_receivers) {}
+
+RateLimiter::Entry& RateLimiter::entry(const sockaddr_in& receiver) {
+    clock::time_point now = clock::now();
+    auto it = _receivers.find(receiver);
+    if (it == _receivers.end()) {
+        if (_receivers.size() >= _max_receivers) {
+            // the table is full, forget whoever's been quiet the longest
+            auto lru = std::min_element(_receivers.begin(), _receivers.end(), [](const auto& a, const auto& b) {
+                return a.second.last_refill < b.second.last_refill;
+            });
+            _receivers.erase(lru);
+        }
+        return _receivers[receiver] = {_byte_rate, _packet_rate, now, {}};
+    }
+
+    // refill, up to one second's worth
+    Entry& e = it->second;
+    double elapsed  = std::chrono::duration<double>(now - e.last_refill).count();
+    e.byte_tokens   = std::min(_byte_rate, e.byte_tokens + elapsed * _byte_rate);
+    e.packet_tokens = std::min(_packet_rate, e.packet_tokens + elapsed * _packet_rate);
+    e.last_refill   = now;
+    return e;
+}
+
+size_t RateLimiter::budget(const sockaddr_in& receiver, const size_t pkt_size) {
+    const Entry& e = entry(receiver);
+    size_t npackets = std::numeric_limits<size_t>::max();
+    if (_byte_rate > 0)
+        npackets = std::min(npackets, (size_t)std::max(0.0, e.byte_tokens / pkt_size));
+    if (_packet_rate > 0)
+        npackets = std::min(npackets, (size_t)std::max(0.0, e.packet_tokens));
+    return npackets;
+}
+
+const RateLimiter::Usage& RateLimiter::charge(const sockaddr_in& receiver, const size_t npackets,
+                                              const size_t pkt_size, const size_t ntrimmed) {
+    Entry& e = entry(receiver);
+    e.byte_tokens    -= (double)npackets * pkt_size;
+    e.packet_tokens  -= npackets;
+    e.usage.npackets += npackets;
+    e.usage.nbytes   += npackets * pkt_size;
+    e.usage.ntrimmed += ntrimmed;
+    return e.usage;
+}
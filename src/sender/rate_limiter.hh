@@ -0,0 +1,69 @@
+#pragma once
+
+#include <netinet/in.h>
+#include <cstddef>
+
+#include <map>
+#include <chrono>
+
+/**
+ * @class RateLimiter
+ * @brief Per-receiver token buckets limiting the retransmission rate.
+ *
+ * Every receiver gets two buckets - one of bytes and one of packets - refilled at
+ * the configured rates and holding at most one second's worth of tokens. The table
+ * of receivers is bounded: once it's full, the receiver that was heard from least
+ * recently makes room for a new one.
+ */
+class RateLimiter {
+public:
+    using clock = std::chrono::steady_clock;
+
+    /// Retransmissions to a single receiver, so far.
+    struct Usage {
+        size_t npackets = 0; ///< Number of packets retransmitted.
+        size_t nbytes   = 0; ///< Number of bytes retransmitted.
+        size_t ntrimmed = 0; ///< Number of packets refused for being over the budget.
+    };
+
+    /**
+     * @brief Constructs a rate limiter with an empty table.
+     * @param byte_rate Bytes per second a receiver may be retransmitted (0 - unlimited).
+     * @param packet_rate Packets per second a receiver may be retransmitted (0 - unlimited).
+     * @param max_receivers Maximum number of receivers tracked at once.
+     */
+    RateLimiter(size_t byte_rate, size_t packet_rate, size_t max_receivers);
+
+    /**
+     * @brief Computes how many packets a receiver may be sent right now.
+     * @param receiver The address of the receiver.
+     * @param pkt_size Size of a single packet.
+     * @return The number of packets within both of the receiver's budgets.
+     */
+    size_t budget(const sockaddr_in& receiver, size_t pkt_size);
+
+    /**
+     * @brief Takes the packets sent to a receiver out of its buckets.
+     * @param receiver The address of the receiver, `budget()`-ed before.
+     * @param npackets Number of packets sent.
+     * @param pkt_size Size of a single packet.
+     * @param ntrimmed Number of packets not sent for being over the budget.
+     * @return The receiver's usage so far.
+     */
+    const Usage& charge(const sockaddr_in& receiver, size_t npackets, size_t pkt_size, size_t ntrimmed);
+
+private:
+    struct Entry {
+        double byte_tokens;
+        double packet_tokens;
+        clock::time_point last_refill;
+        Usage usage;
+    };
+
+    double _byte_rate;   ///< Refill rate of the byte buckets (0 - unlimited).
+    double _packet_rate; ///< Refill rate of the packet buckets (0 - unlimited).
+    size_t _max_receivers;
+    std::map<sockaddr_in, Entry> _receivers;
+
+    Entry& entry(const sockaddr_in& receiver);
+};
@@ -3,10 +3,12 @@
 #include "../common/datagram.hh"
 
 #include <poll.h>
+#include <arpa/inet.h>
 
 #include <thread>
 #include <optional>
 #include <sstream>
+#include <algorithm>
 
 using namespace std::chrono;
 
@@ -15,62 +17,106 @@ using namespace std::chrono;
 
 RetransmitterWorker::RetransmitterWorker(
     const volatile sig_atomic_t& running,
-    const SyncedPtr<CircularBuffer>& packet_cache,
-    const SyncedPtr<std::queue<RexmitRequest>>& job_queue,
+    const std::vector<RexmitStation>& stations,
+    const std::shared_ptr<RexmitJobQueue>& job_queue,
     const SyncedPtr<EventQueue>& my_event,
-    const uint64_t session_id,
-    const std::chrono::milliseconds rtime
+    const std::chrono::milliseconds rtime,
+    const size_t mcast_threshold,
+    const RateLimiter& rate_limiter
 )
     : Worker(running, "Retransmitter")
-    , _packet_cache(packet_cache)
+    , _stations(stations)
     , _job_queue(job_queue)
     , _my_event(my_event)
-    , _session_id(session_id)
     , _rtime(rtime)
-    {}
-
-void RetransmitterWorker::handle_retransmission(RexmitRequest&& req) {
-    char pkt_buf[TOTAL_PSIZE(_packet_cache->psize())];
-    memcpy(pkt_buf, &_session_id, sizeof(_session_id));
+    , _mcast_threshold(mcast_threshold)
+    , _rate_limiter(rate_limiter)
+{
+    _data_socket.set_mcast_ttl();
+}
 
-    std::sort(req.packet_ids.begin(), req.packet_ids.end());
+static std::string ids_to_str(const std::vector<uint64_t>& ids) {
+    std::ostringstream oss;
+    oss << "[";
+    if (!ids.empty()) {
+        oss << ids.front();
+        for (size_t i = 1; i < ids.size(); ++i)
+            oss << ", " << ids[i];
+    }
+    oss << "]";
+    return oss.str();
+}
 
-    auto it = req.packet_ids.begin();
-    // skip packets before the tail
-    auto lock = _packet_cache.lock();
-    while (it != req.packet_ids.end() && *it < _packet_cache->abs_tail())
-        ++it;
-    if (it == req.packet_ids.end())
-        return; // nothing to do
+std::vector<uint64_t> RetransmitterWorker::popular_ids(const size_t station, const size_t njobs) const {
+    std::vector<uint64_t> ids;
+    if (_mcast_threshold == 0)
+        return ids;
+
+    // every receiver counts once per packet, no matter how many times it asked for it
+    std::vector<std::pair<uint64_t, sockaddr_in>> requests;
+    for (size_t i = 0; i < njobs; ++i)
+        if (_jobs[i].station == station)
+            for (uint64_t id : _jobs[i].packet_ids)
+                requests.emplace_back(id, _jobs[i].receiver_addr);
+    std::sort(requests.begin(), requests.end());
+    requests.erase(std::unique(requests.begin(), requests.end()), requests.end());
+
+    for (size_t i = 0, j; i < requests.size(); i = j) {
+        for (j = i; j < requests.size() && requests[j].first == requests[i].first; ++j);
+        if (j - i >= _mcast_threshold)
+            ids.push_back(requests[i].first);
+    }
+    return ids;
+}
 
+void RetransmitterWorker::retransmit(RexmitStation& station, const std::vector<uint64_t>& ids, const sockaddr_in& dst_addr,
+                                     const std::vector<uint64_t>& skipped_ids, const bool multicast) {
     std::vector<uint64_t> retransmitted_ids;
-    // this could have been optimized by copying the buffer or somehow locking it in the loop
-    uint64_t cache_packet_num = _packet_cache->abs_tail();
-    size_t cache_idx = _packet_cache->tail();
-    for (; it != req.packet_ids.end(); ++it) {
-        while (cache_packet_num != _packet_cache->abs_head() && cache_packet_num < *it) {
-            cache_packet_num += _packet_cache->psize();
-            cache_idx = (cache_idx + _packet_cache->psize()) % _packet_cache->rounded_cap();
+    const PacketCache& packet_cache = *station.packet_cache;
+    const size_t pkt_size = packet_cache.packet_size();
+    _packet.resize(pkt_size);
+
+    // multicast serves everyone, so it isn't charged to any single receiver
+    size_t budget   = multicast ? SIZE_MAX : _rate_limiter.budget(dst_addr, pkt_size);
+    size_t ntrimmed = 0;
+    for (uint64_t id : ids) {
+        if (std::binary_search(skipped_ids.begin(), skipped_ids.end(), id))
+            continue; // already multicast
+        if (retransmitted_ids.size() == budget) {
+            ntrimmed++; // the receiver will ask again, if it still needs it
+            continue;
         }
-        if (cache_packet_num != _packet_cache->abs_head())
-            break; // no more packets in cache
-        memcpy(pkt_buf + sizeof(uint64_t), &cache_packet_num, sizeof(uint64_t));
-        memcpy(pkt_buf + 2 * sizeof(uint64_t), _packet_cache->data() + cache_idx, _packet_cache->psize());
-        if (sizeof(pkt_buf) != _data_socket.sendto(pkt_buf, sizeof(pkt_buf), req.receiver_addr))
+        // copied out rather than sent from the cache, which the audio sender may overwrite at any time
+        if (!packet_cache.copy(id, _packet.data()))
+            continue; // evicted, not sent yet or not a packet boundary
+        if ((ssize_t)pkt_size != _data_socket.sendto(_packet.data(), pkt_size, dst_addr))
             fatal("[%s], packet retransmission failed", name.c_str());
-        retransmitted_ids.push_back(cache_packet_num);
+        retransmitted_ids.push_back(id);
     }
 
+    log_info("[%s] %sretransmitted packets of %s : %s", name.c_str(), multicast ? "multicast-" : "",
+             station.name.c_str(), ids_to_str(retransmitted_ids).c_str());
 
-    std::ostringstream oss;
-    oss << "[";
-    if (!retransmitted_ids.empty()) {
-        oss << retransmitted_ids.front();
-        for (size_t i = 1; i < retransmitted_ids.size(); ++i)
-            oss << ", " << retransmitted_ids[i];
+    if (multicast)
+        return;
+    const RateLimiter::Usage& usage = _rate_limiter.charge(dst_addr, retransmitted_ids.size(), pkt_size, ntrimmed);
+    if (ntrimmed > 0)
+        log_warn("[%s] %s:%u is over its retransmission budget, trimmed %zu packets (so far: %zu packets, %zu bytes sent, %zu trimmed)",
+                 name.c_str(), inet_ntoa(dst_addr.sin_addr), ntohs(dst_addr.sin_port), ntrimmed,
+                 usage.npackets, usage.nbytes, usage.ntrimmed);
+}
+
+void RetransmitterWorker::handle_retransmissions(const size_t njobs) {
+    for (size_t i = 0; i < _stations.size(); ++i) {
+        // packets asked for by many receivers are sent once to the whole group instead
+        std::vector<uint64_t> mcast_ids = popular_ids(i, njobs);
+        if (!mcast_ids.empty())
+            retransmit(_stations[i], mcast_ids, _stations[i].mcast_addr, {}, true);
+
+        for (size_t j = 0; j < njobs; ++j)
+            if (_jobs[j].station == i)
+                retransmit(_stations[i], _jobs[j].packet_ids, _jobs[j].receiver_addr, mcast_ids, false);
     }
-    oss << "]";
-    log_info("[%s] retransmitted packets : %s", name.c_str(), oss.str().c_str());
 }
 
 void RetransmitterWorker::run() {
@@ -81,7 +127,6 @@ void RetransmitterWorker::run() {
         poll_fds[i].revents = 0;
     }
 
-    steady_clock::time_point prev_sleep = steady_clock::now();
     while (running) {
         if (poll(poll_fds, NUM_POLLFDS, -1)) == -1)
             fatal("poll");
@@ -93,18 +138,27 @@ void RetransmitterWorker::run() {
                 case EventQueue::EventType::TERMINATE:
                     return;
                 case EventQueue::EventType::NEW_JOBS: {
-                    size_t new_jobs;
-                    {
-                        auto lock = _job_queue.lock();
-                        new_jobs = _job_queue->size();
+                    if (_job_queue->empty()) {
+                        // already answered in the previous series - but this wakeup may have been posted
+                        // after that series rearmed the queue, so rearm it again, or no push would ever
+                        // wake us up anymore; then look once more, for a push racing with the rearm
+                        _job_queue->rearm();
+                        if (_job_queue->empty())
+                            break;
                     }
-                    std::this_thread::sleep_until(prev_sleep + _rtime);
-                    prev_sleep = steady_clock::now();
-
-                    while (new_jobs--) {
-                        handle_retransmission(std::move(_job_queue->front()));
-                        _job_queue->pop();
+                    // gather requests for RTIME, then answer all of them in one series
+                    std::this_thread::sleep_for(_rtime);
+
+                    _job_queue->rearm();
+                    size_t njobs = 0;
+                    while (true) {
+                        if (njobs == _jobs.size())
+                            _jobs.emplace_back();
+                        if (!_job_queue->pop(_jobs[njobs]))
+                            break;
+                        njobs++;
                     }
+                    handle_retransmissions(njobs);
                 }
 
                 default: break;
@@ -2,35 +2,53 @@
 
 #include "../common/worker.hh"
 #include "../common/event_queue.hh"
-#include "../common/circular_buffer.hh"
 #include "../common/udp_socket.hh"
 #include "../common/synced_ptr.hh"
+#include "packet_cache.hh"
+#include "rate_limiter.hh"
+#include "rexmit_job_queue.hh"
 
 #include <netinet/in.h>
 #include <cstddef>
 
-#include <queue>
 #include <chrono>
+#include <vector>
+#include <string>
+#include <memory>
+
+/// A hosted station, as far as retransmissions are concerned.
+struct RexmitStation {
+    std::string name;
+    sockaddr_in mcast_addr;
+    std::shared_ptr<PacketCache> packet_cache;
+};
 
 struct RetransmitterWorker : public Worker {
 private:
-    SyncedPtr<CircularBuffer> _packet_cache;
-    SyncedPtr<std::queue<RexmitRequest>> _job_queue;
+    std::vector<RexmitStation> _stations;
+    std::shared_ptr<RexmitJobQueue> _job_queue;
+    std::vector<RexmitJob> _jobs; ///< Jobs being handled, reused along with their packet id vectors.
     SyncedPtr<EventQueue> _my_event;
-    uint64_t _session_id;
     std::chrono::milliseconds _rtime;
+    size_t _mcast_threshold; ///< Number of receivers asking for a packet for it to be multicast (0 - never).
+    RateLimiter _rate_limiter;
     UdpSocket _data_socket;
+    std::vector<char> _packet; ///< A packet copied out of a cache.
 
-    void handle_retransmission(RexmitRequest&& req);
+    std::vector<uint64_t> popular_ids(size_t station, size_t njobs) const;
+    void retransmit(RexmitStation& station, const std::vector<uint64_t>& ids, const sockaddr_in& dst_addr,
+                    const std::vector<uint64_t>& skipped_ids, bool multicast);
+    void handle_retransmissions(size_t njobs);
 public:
     RetransmitterWorker() = delete;
     RetransmitterWorker(
         const volatile sig_atomic_t& running,
-        const SyncedPtr<CircularBuffer>& packet_cache,
-        const SyncedPtr<std::queue<RexmitRequest>>& job_queue,
+        const std::vector<RexmitStation>& stations,
+        const std::shared_ptr<RexmitJobQueue>& job_queue,
         const SyncedPtr<EventQueue>& my_event,
-        const uint64_t session_id,
-        const std::chrono::milliseconds rtime
+        const std::chrono::milliseconds rtime,
+        const size_t mcast_threshold,
+        const RateLimiter& rate_limiter
     );
 
     void run() override;
@@ -0,0 +1,70 @@
+#include "rexmit_job_queue.hh"
+
+#include <bit>
+#include <algorithm>
+
+RexmitJobQueue::RexmitJobQueue(const size_t capacity)
+    : _mask(std::bit_ceil(std::max(capacity, (size_t)2)) - 1)
+    , _cells(new Cell[_mask + 1])
+    , _tail(0)
+    , _head(0)
+    , _awake(false)
+    , _ndropped(0)
+{
+    for (size_t i = 0; i <= _mask; ++i)
+        _cells[i].seq.store(i, std::memory_order_relaxed);
+}
+
+RexmitJobQueue::PushResult RexmitJobQueue::push(const size_t station, const sockaddr_in& receiver_addr,
+                                                const std::span<const uint64_t> packet_ids) {
+    size_t pos = _tail.load(std::memory_order_relaxed);
+    Cell* cell;
+    while (true) {
+        cell = &_cells[pos & _mask];
+        size_t seq = cell->seq.load(std::memory_order_acquire);
+        if (seq == pos) {
+            // the cell is free, claim it
+            if (_tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                break;
+        } else if (seq < pos) {
+            // the consumer hasn't freed the cell yet, the queue is full
+            _ndropped.fetch_add(1, std::memory_order_relaxed);
+            return PushResult::DROPPED;
+        } else
+            pos = _tail.load(std::memory_order_relaxed); // another producer got there first
+    }
+
+    cell->job.station       = station;
+    cell->job.receiver_addr = receiver_addr;
+    cell->job.packet_ids.assign(packet_ids.begin(), packet_ids.end());
+    cell->seq.store(pos + 1, std::memory_order_release);
+
+    return _awake.exchange(true, std::memory_order_acq_rel) ? PushResult::QUEUED : PushResult::QUEUED_WAKEUP;
+}
+
+bool RexmitJobQueue::pop(RexmitJob& job) {
+    Cell& cell = _cells[_head & _mask];
+    if (cell.seq.load(std::memory_order_acquire) != _head + 1)
+        return false; // empty, or a producer is still filling the cell in
+
+    job.station       = cell.job.station;
+    job.receiver_addr = cell.job.receiver_addr;
+    job.packet_ids.swap(cell.job.packet_ids);
+    cell.seq.store(_head + _mask + 1, std::memory_order_release);
+    _head++;
+    return true;
+}
+
+bool RexmitJobQueue::empty() const {
+    return _cells[_head & _mask].seq.load(std::memory_order_acquire) != _head + 1;
+}
+
+void RexmitJobQueue::rearm() {
+    // a read-modify-write, so that it synchronizes with the exchange of the last push that
+    // found the consumer awake - whose job then shows up in the following empty()/pop()
+    _awake.exchange(false, std::memory_order_acq_rel);
+}
+
+size_t RexmitJobQueue::ndropped() const {
+    return _ndropped.load(std::memory_order_relaxed);
+}
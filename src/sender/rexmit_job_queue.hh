@@ -0,0 +1,90 @@
+#pragma once
+
+#include <netinet/in.h>
+#include <cstddef>
+#include <cstdint>
+
+#include <atomic>
+#include <memory>
+#include <span>
+#include <vector>
+
+/// A rexmit request, along with the station it was sent to.
+struct RexmitJob {
+    size_t station;                   ///< Index of the station.
+    sockaddr_in receiver_addr;        ///< Address of the requesting receiver.
+    std::vector<uint64_t> packet_ids; ///< Requested packet ids.
+};
+
+/**
+ * @class RexmitJobQueue
+ * @brief A bounded, lock-free queue of rexmit jobs with many producers and a single consumer.
+ *
+ * The jobs live in a preallocated ring of cells, each with its own sequence number
+ * telling whether it's free for producers or ready for the consumer (after Dmitry
+ * Vyukov's bounded queue). Packet id vectors are swapped, not copied, between the
+ * cells and the consumer, so once they've grown, queueing a job allocates nothing.
+ *
+ * When the queue is full, the newest job is dropped - the receiver asks again within
+ * RTIME anyway - and counted.
+ *
+ * Producers learn from `push()` whether the consumer needs waking up, which happens
+ * once per batch of jobs rather than once per job.
+ */
+class RexmitJobQueue {
+public:
+    /**
+     * @brief Constructs an empty queue.
+     * @param capacity Maximum number of queued jobs, rounded up to a power of two.
+     */
+    RexmitJobQueue(size_t capacity);
+
+    /// Outcome of a `push()`.
+    enum class PushResult {
+        QUEUED,        ///< Queued, the consumer has already been woken up.
+        QUEUED_WAKEUP, ///< Queued, the producer should wake the consumer up.
+        DROPPED,       ///< The queue was full.
+    };
+
+    /**
+     * @brief Queues a job. Safe to call from many threads at once.
+     * @param station Index of the station the request was sent to.
+     * @param receiver_addr Address of the requesting receiver.
+     * @param packet_ids Requested packet ids.
+     * @return Whether the job was queued and whether the consumer should be woken up.
+     */
+    PushResult push(size_t station, const sockaddr_in& receiver_addr, std::span<const uint64_t> packet_ids);
+
+    /**
+     * @brief Dequeues a job. Consumer only.
+     * @param job Filled with the job; its packet id vector is swapped with the queued one.
+     * @return False if the queue is empty.
+     */
+    bool pop(RexmitJob& job);
+
+    /// @return True if there's no job ready to be popped. Consumer only.
+    bool empty() const;
+
+    /**
+     * @brief Lets the next `push()` wake the consumer up again. Consumer only.
+     *
+     * Called before draining the queue, so that a job queued meanwhile isn't missed.
+     */
+    void rearm();
+
+    /// @return Number of jobs dropped so far for the queue being full.
+    size_t ndropped() const;
+
+private:
+    struct Cell {
+        std::atomic<size_t> seq;
+        RexmitJob job;
+    };
+
+    size_t _mask;
+    std::unique_ptr<Cell[]> _cells;
+    alignas(64) std::atomic<size_t> _tail; ///< Position of the next push.
+    alignas(64) size_t _head;              ///< Position of the next pop.
+    std::atomic<bool> _awake;              ///< Whether the consumer has been woken up and hasn't drained yet.
+    std::atomic<size_t> _ndropped;
+};
@@ -4,27 +4,28 @@
 #include "controller.hh"
 
 #include <thread>
+#include <vector>
 
 #define RETRANSMITTER 0
-#define CONTROLLER    1
-#define AUDIO_SENDER  2
-#define NUM_WORKERS   3
+#define CONTROLLER    1 ///< The first of the controllers, followed by the stations' audio senders.
 
 static volatile sig_atomic_t running = true;
-static bool signalled[NUM_WORKERS];
-static SyncedPtr<EventQueue> event_queues[NUM_WORKERS];
+static size_t num_workers;
+static size_t audio_sender; ///< The first of the stations' audio senders.
+static std::unique_ptr<bool[]> signalled;
+static std::vector<SyncedPtr<EventQueue>> event_queues;
 
 static void terminate_worker(const int worker_id) {
     if (!signalled[worker_id]) { // ńecessary check for the handler to be reentrant
         event_queues[worker_id].lock();
         signalled[worker_id] = true;
-        event_queues[worker_id]->push(EventQueue::EventType::TERMINATE);
+        event_queues[worker_id]->terminate();
     }
 }
 
 static void signal_handler(int signum) {
     log_warn("Received %s. Shutting down...", strsignal(signum));
-    for (int i = NUM_WORKERS - 1; i >= 0; --i)
+    for (int i = num_workers - 1; i >= 0; --i)
         terminate_worker(i);
     running = false;
 }
@@ -32,6 +33,20 @@ static void signal_handler(int signum) {
 int main(int argc, char* argv[]) {
     logger_init();
 
+    SenderParams params;
+    try {
+        params = SenderParams(argc, argv);
+    } catch (const std::exception& e) {
+        fatal(e.what());
+    }
+
+    // all stations share the controllers and the retransmitter, but each has its own audio sender
+    const size_t num_stations = params.stations.size();
+    audio_sender = CONTROLLER + params.ctrl_threads;
+    num_workers  = audio_sender + num_stations;
+    signalled    = std::make_unique<bool[]>(num_workers);
+    event_queues = std::vector<SyncedPtr<EventQueue>>(num_workers);
+
     struct sigaction sa;
     sa.sa_handler = signal_handler;
     sigemptyset(&sa.sa_mask);
@@ -39,44 +54,58 @@ int main(int argc, char* argv[]) {
     sigaction(SIGINT, &sa, NULL);
     sigaction(SIGTERM, &sa, NULL);
 
-    SenderParams params;
-    try {
-        params = SenderParams(argc, argv);
-    } catch (const std::exception& e) {
-        fatal(e.what());
+    std::vector<RexmitStation> rexmit_stations;
+    for (const auto& station : params.stations) {
+        size_t nstaging = params.batch + (station.input.empty() ? AudioSenderWorker::ingest_slots(params.psize) : 0);
+        rexmit_stations.push_back({
+            station.name,
+            get_addr(station.mcast_addr.c_str(), station.data_port),
+            std::make_shared<PacketCache>(params.session_id, params.psize, params.fsize, nstaging)
+        });
     }
+    auto rexmit_job_queue = std::make_shared<RexmitJobQueue>(params.rexmit_queue);
 
-    sockaddr_in mcast_addr = get_addr(params.mcast_addr.c_str(), params.data_port);
-    auto packet_cache     = SyncedPtr<CircularBuffer>::make(params.fsize);
-    packet_cache->reset(params.psize);
-    auto rexmit_job_queue = SyncedPtr<std::queue<RexmitRequest>>::make();
-
-    std::shared_ptr<Worker> workers[NUM_WORKERS];
-    std::thread worker_threads[NUM_WORKERS];
+    std::vector<std::shared_ptr<Worker>> workers(num_workers);
+    std::vector<std::thread> worker_threads(num_workers);
 
     workers[RETRANSMITTER] = std::make_shared<RetransmitterWorker>(
-        running, packet_cache, rexmit_job_queue,
-        event_queues[RETRANSMITTER], params.session_id, params.rtime
-    );
-    workers[CONTROLLER] = std::make_shared<ControllerWorker>(
-        running, event_queues[CONTROLLER],
-        event_queues[RETRANSMITTER], rexmit_job_queue,
-        params.mcast_addr, params.data_port, params.name,
-        params.ctrl_port
-    );
-    workers[AUDIO_SENDER] = std::make_shared<AudioSenderWorker>(
-        running, mcast_addr, packet_cache,
-        event_queues[AUDIO_SENDER], params.psize,
-        params.session_id
+        running, rexmit_stations, rexmit_job_queue,
+        event_queues[RETRANSMITTER], params.rtime,
+        params.mcast_rexmit,
+        RateLimiter(params.rexmit_byte_rate, params.rexmit_packet_rate, params.max_receivers)
     );
+    // the first controller binds the ephemeral ports of the stations, the others share them
+    std::vector<in_port_t> ctrl_ports(num_stations, 0);
+    ctrl_ports[0] = params.ctrl_port;
+    for (size_t i = 0; i < params.ctrl_threads; ++i) {
+        auto controller = std::make_shared<ControllerWorker>(
+            running, event_queues[CONTROLLER + i],
+            event_queues[RETRANSMITTER], rexmit_job_queue,
+            params.stations, ctrl_ports, i, params.ctrl_threads > 1
+        );
+        if (i == 0)
+            ctrl_ports = controller->ctrl_ports();
+        workers[CONTROLLER + i] = controller;
+    }
+    for (size_t i = 0; i < num_stations; ++i)
+        workers[audio_sender + i] = std::make_shared<AudioSenderWorker>(
+            running, rexmit_stations[i].mcast_addr, rexmit_stations[i].packet_cache,
+            event_queues[audio_sender + i], params.psize,
+            params.batch, params.gso,
+            params.stations[i].input, params.rate, params.txtime,
+            params.fec_ndata, params.fec_nparity,
+            params.busy_poll, params.io_backend,
+            params.stations[i].name
+        );
 
-    for (int i = 0; i < NUM_WORKERS; ++i)
+    for (size_t i = 0; i < num_workers; ++i)
         worker_threads[i] = std::thread([w = workers[i]] { w->run(); });
 
-    worker_threads[AUDIO_SENDER].join();
-    // when the sender terminiates, the remaining workers should too
+    for (size_t i = audio_sender; i < num_workers; ++i)
+        worker_threads[i].join();
+    // when the senders terminiate, the remaining workers should too
     raise(SIGINT);
-    for (int i = NUM_WORKERS - 2; i >= 0; --i)
+    for (int i = audio_sender - 1; i >= 0; --i)
         worker_threads[i].join();
 
     logger_destroy();
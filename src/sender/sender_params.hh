@@ -4,22 +4,78 @@
 #include "../common/except.hh"
 #include "../common/datagram.hh"
 #include "../common/radio_station.hh"
+#include "../common/udp_socket.hh"
+#include "../common/io_uring.hh"
+#include "../common/fec.hh"
 
 #include <netinet/in.h>
 #include <cstddef>
+#include <charconv>
+#include <climits>
 
 #include <string>
+#include <vector>
 #include <chrono>
+#include <algorithm>
 #include <iostream>
 
 #include <boost/program_options.hpp>
 
 namespace bpo = boost::program_options;
 
-struct SenderParams {
+/// A station hosted by the sender.
+struct StationParams {
     std::string name, mcast_addr;
-    in_port_t data_port, ctrl_port;
+    in_port_t data_port;
+    std::string input; ///< Raw audio file to send, stdin if empty.
+
+    StationParams() = default;
+
+    StationParams(const std::string& name, const std::string& mcast_addr, const in_port_t data_port, const std::string& input)
+        : name(name), mcast_addr(mcast_addr), data_port(data_port), input(input) {}
+
+    /**
+     * @brief Parses a station given as `MCAST_ADDR:[DATA_PORT]:[INPUT]:NAME`.
+     * @param spec The station specification; the name goes last, so it may contain colons.
+     * @param default_data_port Data port of the station, if `spec` doesn't give one.
+     */
+    StationParams(const std::string& spec, const in_port_t default_data_port) {
+        size_t port_begin  = spec.find(':');
+        size_t input_begin = port_begin == std::string::npos ? port_begin : spec.find(':', port_begin + 1);
+        size_t name_begin  = input_begin == std::string::npos ? input_begin : spec.find(':', input_begin + 1);
+        if (name_begin == std::string::npos)
+            throw RadioException("STATION must be MCAST_ADDR:[DATA_PORT]:[INPUT]:NAME");
+
+        mcast_addr = spec.substr(0, port_begin);
+        std::string port = spec.substr(port_begin + 1, input_begin - port_begin - 1);
+        input = spec.substr(input_begin + 1, name_begin - input_begin - 1);
+        name  = spec.substr(name_begin + 1);
+
+        data_port = default_data_port;
+        if (!port.empty()) {
+            auto [end, ec] = std::from_chars(port.data(), port.data() + port.size(), data_port);
+            if (ec != std::errc() || end != port.data() + port.size())
+                throw RadioException("DATA_PORT of station " + name + " is invalid");
+        }
+    }
+};
+
+struct SenderParams {
+    std::vector<StationParams> stations;
+    in_port_t ctrl_port;
+    size_t ctrl_threads;
     size_t psize, fsize;
+    size_t batch;
+    bool gso;
+    size_t mcast_rexmit;
+    size_t rexmit_byte_rate, rexmit_packet_rate;
+    size_t max_receivers;
+    size_t rexmit_queue;
+    size_t fec_ndata, fec_nparity;
+    size_t rate;
+    bool txtime;
+    std::chrono::microseconds busy_poll;
+    IoBackend io_backend;
     uint64_t session_id;
     std::chrono::milliseconds rtime;
 
@@ -33,9 +89,25 @@ struct SenderParams {
             ("mcast_addr,a", bpo::value<std::string>(), "MCAST_ADDR")
             ("data_port,P",  bpo::value<in_port_t>()->default_value(29629), "DATA_PORT")
             ("ctrl_port,C",  bpo::value<in_port_t>()->default_value(39629), "CTRL_PORT")
-            ("psize,p",      bpo::value<size_t>()->default_value(512), "PSIZE")
+            ("ctrl_threads,T", bpo::value<size_t>()->default_value(1), "controller threads sharing the control ports (SO_REUSEPORT); rexmit requests are spread among them, broadcast and multicast lookups are answered by the first one only")
+            ("psize,p",      bpo::value<std::string>()->default_value("512"), "PSIZE, or auto for the largest one that isn't fragmented")
             ("fsize,f",      bpo::value<size_t>()->default_value(131072), "FSIZE")
-            ("rtime,R",      bpo::value<size_t>()->default_value(250), "RTIME");
+            ("rtime,R",      bpo::value<size_t>()->default_value(250), "RTIME")
+            ("batch,b",      bpo::value<size_t>()->default_value(1), "max packets sent per syscall (sendmmsg)")
+            ("gso,g",        bpo::bool_switch()->default_value(false), "send batches as UDP GSO super-datagrams")
+            ("mcast_rexmit,M", bpo::value<size_t>()->default_value(0), "multicast a retransmission once this many receivers ask for it within RTIME (0 - never)")
+            ("input,i",      bpo::value<std::string>()->default_value(""), "raw audio file to send instead of stdin")
+            ("rate,r",       bpo::value<size_t>()->default_value(176400), "bytes per second INPUT is sent at")
+            ("txtime,t",     bpo::bool_switch()->default_value(false), "let the kernel pace INPUT (SO_TXTIME)")
+            ("rexmit_byte_rate,B",   bpo::value<size_t>()->default_value(0), "bytes per second retransmitted to a single receiver, at least PSIZE + 16 (0 - unlimited)")
+            ("rexmit_packet_rate,Q", bpo::value<size_t>()->default_value(0), "packets per second retransmitted to a single receiver (0 - unlimited)")
+            ("max_receivers,m", bpo::value<size_t>()->default_value(1024), "number of receivers whose retransmission budgets are tracked")
+            ("rexmit_queue,q", bpo::value<size_t>()->default_value(1024), "max rexmit requests waiting for the retransmitter")
+            ("fec_ndata,F",   bpo::value<size_t>()->default_value(0), "data packets per FEC group (0 - no FEC)")
+            ("fec_nparity,K", bpo::value<size_t>()->default_value(1), "XOR parity packets per FEC group, sent to DATA_PORT + 1")
+            ("busy_poll,u",  bpo::value<size_t>()->default_value(0), "microseconds audio senders spin in userspace, polling for input without blocking, before blocking (0 - never)")
+            ("io_backend,I", bpo::value<std::string>()->default_value("poll"), "how audio packets are sent: poll (sendto/sendmmsg) or io_uring")
+            ("station,S",    bpo::value<std::vector<std::string>>()->composing(), "host another station, given as MCAST_ADDR:[DATA_PORT]:[INPUT]:NAME");
 
         bpo::variables_map vm;
         bpo::store(bpo::parse_command_line(argc, argv, desc), vm);
@@ -46,27 +118,112 @@ struct SenderParams {
             exit(EXIT_SUCCESS);
         }
 
-        if (!vm.count("mcast_addr"))
+        if (!vm.count("mcast_addr") && !vm.count("station"))
             throw RadioException("MCAST_ADDR is required");
 
+        in_port_t data_port = vm["data_port"].as<in_port_t>();
+        if (vm.count("mcast_addr"))
+            stations.emplace_back(vm["name"].as<std::string>(), vm["mcast_addr"].as<std::string>(),
+                                  data_port, vm["input"].as<std::string>());
+        if (vm.count("station"))
+            for (const auto& spec : vm["station"].as<std::vector<std::string>>())
+                stations.emplace_back(spec, data_port);
+
         session_id = (uint64_t)time(NULL);
-        name       = vm["name"].as<std::string>();
-        mcast_addr = vm["mcast_addr"].as<std::string>();
-        data_port  = vm["data_port"].as<in_port_t>();
         ctrl_port  = vm["ctrl_port"].as<in_port_t>();
-        psize      = vm["psize"].as<size_t>();
+        ctrl_threads = vm["ctrl_threads"].as<size_t>();
+        const std::string psize_arg = vm["psize"].as<std::string>();
+        if (psize_arg != "auto") {
+            auto [end, ec] = std::from_chars(psize_arg.data(), psize_arg.data() + psize_arg.size(), psize);
+            if (ec != std::errc() || end != psize_arg.data() + psize_arg.size())
+                throw RadioException("PSIZE must be a number or auto");
+        }
         fsize      = vm["fsize"].as<size_t>();
         rtime      = std::chrono::milliseconds(vm["rtime"].as<size_t>());
+        batch      = vm["batch"].as<size_t>();
+        gso        = vm["gso"].as<bool>();
+        mcast_rexmit = vm["mcast_rexmit"].as<size_t>();
+        rate       = vm["rate"].as<size_t>();
+        rexmit_byte_rate   = vm["rexmit_byte_rate"].as<size_t>();
+        rexmit_packet_rate = vm["rexmit_packet_rate"].as<size_t>();
+        max_receivers      = vm["max_receivers"].as<size_t>();
+        rexmit_queue       = vm["rexmit_queue"].as<size_t>();
+        fec_ndata          = vm["fec_ndata"].as<size_t>();
+        fec_nparity        = vm["fec_nparity"].as<size_t>();
+        txtime     = vm["txtime"].as<bool>();
+        busy_poll  = std::chrono::microseconds(vm["busy_poll"].as<size_t>());
+        if (!parse_io_backend(vm["io_backend"].as<std::string>(), io_backend))
+            throw RadioException("IO_BACKEND must be poll or io_uring");
+
+        if (fsize < 1)
+            throw RadioException("FSIZE must be positive");
+        if (rate < 1)
+            throw RadioException("RATE must be positive");
+        if (max_receivers < 1)
+            throw RadioException("MAX_RECEIVERS must be positive");
+        if (ctrl_threads < 1)
+            throw RadioException("CTRL_THREADS must be positive");
+        if (rexmit_queue < 1)
+            throw RadioException("REXMIT_QUEUE must be positive");
+        if (fec_ndata > UINT16_MAX)
+            throw RadioException("FEC_NDATA too big");
+        if (fec_ndata && (fec_nparity < 1 || fec_nparity > fec_ndata || fec_nparity > UdpSocket::MAX_BATCH))
+            throw RadioException("FEC_NPARITY must be between 1 and min(FEC_NDATA, " + std::to_string(UdpSocket::MAX_BATCH) + ")");
+        if (batch < 1 || batch > UdpSocket::MAX_BATCH)
+            throw RadioException("BATCH must be between 1 and " + std::to_string(UdpSocket::MAX_BATCH));
+
+        size_t nstdin = 0;
+        for (const auto& station : stations) {
+            if (!RadioStation::is_valid_name(station.name))
+                throw RadioException("NAME " + station.name + " is invalid");
+            if (!get_mcast_addr(station.mcast_addr.c_str(), 0))
+                throw RadioException("MCAST_ADDR of station " + station.name + " is not a valid multicast address");
+            if (station.input.empty())
+                nstdin++;
+            if (fec_ndata && station.data_port == UINT16_MAX)
+                throw RadioException("DATA_PORT of station " + station.name + " leaves no port for parity packets");
+        }
+        if (nstdin > 1)
+            throw RadioException("at most one station can read stdin");
 
+        if (psize_arg == "auto")
+            psize = auto_psize();
         if (psize < 1)
             throw RadioException("PSIZE must be positive");
         if (psize > AudioPacket::MAX_PSIZE)
             throw RadioException("PSIZE too big");
-        if (fsize < 1)
-            throw RadioException("FSIZE must be positive");
-        if (!RadioStation::is_valid_name(name))
-            throw RadioException("NAME is invalid");
-        if (!get_mcast_addr(mcast_addr.c_str(), 0))
-            throw RadioException("MCAST_ADDR is not a valid multicast address");
+        // the budget tops up to a second's worth, which has to fit at least one packet
+        if (rexmit_byte_rate && rexmit_byte_rate < TOTAL_PSIZE(psize))
+            throw RadioException("REXMIT_BYTE_RATE must be 0 or at least " + std::to_string(TOTAL_PSIZE(psize)));
+    }
+
+private:
+    /**
+     * @brief Picks the largest PSIZE whose datagrams reach every station's group unfragmented.
+     *
+     * A lost fragment loses the whole packet, so fragmented packets are lost (and retransmitted)
+     * much more often, while packets smaller than necessary waste headers and syscalls.
+     * @return The PSIZE.
+     * @throws RadioException if the path MTU to a station can't be determined.
+     */
+    size_t auto_psize() const {
+        int mtu = INT_MAX;
+        for (const auto& station : stations) {
+            UdpSocket socket;
+            int station_mtu = socket.try_get_path_mtu(get_addr(station.mcast_addr.c_str(), station.data_port));
+            if (station_mtu == -1)
+                throw RadioException("unable to discover the path MTU to " + station.mcast_addr + ", PSIZE must be given");
+            log_info("path MTU to %s (station %s) is %d", station.mcast_addr.c_str(), station.name.c_str(), station_mtu);
+            mtu = std::min(mtu, station_mtu);
+        }
+
+        // parity packets carry a larger header than audio packets, and they mustn't be fragmented either
+        size_t header_size = fec_ndata ? std::max(TOTAL_PSIZE(0), ParityHeader::SIZE) : TOTAL_PSIZE(0);
+        if ((size_t)mtu <= IP_UDP_HDR_SIZE + header_size)
+            throw RadioException("path MTU " + std::to_string(mtu) + " leaves no room for audio, PSIZE must be given");
+        size_t auto_psize = mtu - IP_UDP_HDR_SIZE - header_size;
+        log_info("PSIZE auto: %zu = path MTU %d - %d bytes of IPv4 and UDP headers - %zu bytes of %s header",
+            auto_psize, mtu, IP_UDP_HDR_SIZE, header_size, fec_ndata ? "parity packet" : "audio packet");
+        return auto_psize;
     }
 };